@@ -0,0 +1,114 @@
+//
+//  CRF++ -- Yet Another CRF toolkit
+//
+//  Copyright(C) 2005-2007 Taku Kudo <taku@chasen.org>
+//
+//  Micro-benchmark of addVector(), the row add gradient() uses to
+//  scatter the marginals of a position into the expectations of its
+//  active features. Not installed; build it with `make bench_add_vector'.
+//
+//  usage: bench_add_vector [ysize] [features] [rounds]
+//
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "lattice.h"
+#include "timer.h"
+
+namespace {
+
+const size_t kWeightSize = 4 * 1024 * 1024;  // 32 MB of doubles
+
+// feature blocks of |ysize| weights at random offsets, as gradient()
+// sees them.
+void makeFeatures(size_t n, size_t ysize, std::vector<size_t> *features) {
+  features->resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    (*features)[i] = (std::rand() % (kWeightSize / ysize)) * ysize;
+  }
+}
+
+double checksum(const std::vector<double> &w) {
+  double sum = 0.0;
+  for (size_t i = 0; i < w.size(); ++i) {
+    sum += w[i];
+  }
+  return sum;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const size_t ysize = argc > 1 ? std::atoi(argv[1]) : 23;
+  const size_t nfeature = argc > 2 ? std::atoi(argv[2]) : 5;
+  const size_t rounds = argc > 3 ? std::atoi(argv[3]) : 200000;
+  if (ysize == 0 || ysize > kWeightSize || nfeature == 0) {
+    std::fprintf(stderr,
+                 "usage: %s [ysize] [features] [rounds]\n", argv[0]);
+    return -1;
+  }
+
+  std::vector<double> row(ysize);
+  for (size_t j = 0; j < ysize; ++j) {
+    row[j] = 1.0 / (j + 1);
+  }
+  std::vector<std::vector<size_t> > features(rounds);
+  for (size_t r = 0; r < rounds; ++r) {
+    makeFeatures(nfeature, ysize, &features[r]);
+  }
+
+  std::vector<double> w(kWeightSize, 0.0);
+  CRFPP::timer t;
+
+  // one node at a time: every feature of (i, j), then the next tag
+  t.restart();
+  for (size_t r = 0; r < rounds; ++r) {
+    const std::vector<size_t> &f = features[r];
+    for (size_t j = 0; j < ysize; ++j) {
+      for (size_t k = 0; k < nfeature; ++k) {
+        w[f[k] + j] += row[j];
+      }
+    }
+  }
+  const double scatter = t.elapsed();
+  const double scatter_sum = checksum(w);
+
+  std::fill(w.begin(), w.end(), 0.0);
+  t.restart();
+  for (size_t r = 0; r < rounds; ++r) {
+    const std::vector<size_t> &f = features[r];
+    for (size_t k = 0; k < nfeature; ++k) {
+      double *y = &w[f[k]];
+      for (size_t j = 0; j < ysize; ++j) {
+        y[j] += row[j];
+      }
+    }
+  }
+  const double loop = t.elapsed();
+  const double loop_sum = checksum(w);
+
+  std::fill(w.begin(), w.end(), 0.0);
+  t.restart();
+  for (size_t r = 0; r < rounds; ++r) {
+    const std::vector<size_t> &f = features[r];
+    for (size_t k = 0; k < nfeature; ++k) {
+      CRFPP::addVector(ysize, &row[0], &w[f[k]]);
+    }
+  }
+  const double add = t.elapsed();
+  const double add_sum = checksum(w);
+
+  std::printf("ysize=%u features=%u rounds=%u\n",
+              static_cast<unsigned int>(ysize),
+              static_cast<unsigned int>(nfeature),
+              static_cast<unsigned int>(rounds));
+  std::printf("scatter:   %.3f s\n", scatter);
+  std::printf("row loop:  %.3f s\n", loop);
+  std::printf("addVector: %.3f s\n", add);
+  if (scatter_sum != loop_sum || loop_sum != add_sum) {
+    std::fprintf(stderr, "checksums differ: %.17g %.17g %.17g\n",
+                 scatter_sum, loop_sum, add_sum);
+    return -1;
+  }
+  return 0;
+}
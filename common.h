@@ -38,6 +38,20 @@
 
 #define BUF_SIZE 8192
 
+// x86 builds with GCC or clang also compile some kernels for AVX2 and
+// AVX-512, and pick one at run time.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRFPP_USE_SIMD 1
+#define CRFPP_TARGET_AVX2    __attribute__((target("avx2,fma")))
+#define CRFPP_TARGET_AVX512  __attribute__((target("avx512f")))
+#endif
+
+#ifdef __GNUC__
+#define CRFPP_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define CRFPP_PREFETCH(p)
+#endif
+
 namespace CRFPP {
 // helper functions defined in the paper
 inline double sigma(double x) {
@@ -127,7 +141,35 @@ inline size_t tokenize2(char *str, const char *del,
   return size;
 }
 
+// same as sprintf("%f"). Values in [0, 1000), e.g., probabilities, are
+// rounded to 6 digits with integer arithmetic unless val * 1e6 is too
+// close to a tie for the product to be trusted.
 void inline dtoa(double val, char *s) {
+  if (val >= 0.0 && val < 1000.0) {
+    const double scaled = val * 1000000.0;
+    const double integer = std::floor(scaled);
+    const double frac = scaled - integer;
+    if (std::fabs(frac - 0.5) > 1e-6) {
+      unsigned long n = static_cast<unsigned long>(integer);
+      if (frac > 0.5) ++n;
+      unsigned long ip = n / 1000000;
+      unsigned long fp = n % 1000000;
+      char *t = s;
+      do {
+        *t++ = static_cast<char>(ip % 10) + '0';
+        ip /= 10;
+      } while (ip);
+      std::reverse(s, t);
+      *t++ = '.';
+      for (int i = 5; i >= 0; --i) {
+        t[i] = static_cast<char>(fp % 10) + '0';
+        fp /= 10;
+      }
+      t[6] = '\0';
+      return;
+    }
+  }
+
   std::sprintf(s, "%-16f", val);
   char *p = s;
   for (; *p != ' '; ++p) {}
@@ -50,12 +50,19 @@ extern "C" {
   CRFPP_DLL_EXTERN void           crfpp_model_destroy(crfpp_model_t*);
   CRFPP_DLL_EXTERN const char *   crfpp_model_strerror(crfpp_model_t *);
   CRFPP_DLL_EXTERN crfpp_t*       crfpp_model_new_tagger(crfpp_model_t *);
+  CRFPP_DLL_EXTERN int            crfpp_parse_batch(crfpp_model_t *, size_t,
+                                                    const char **,
+                                                    const char **, size_t);
+  CRFPP_DLL_EXTERN size_t         crfpp_model_result_cache_hit(crfpp_model_t *);
+  CRFPP_DLL_EXTERN size_t         crfpp_model_result_cache_miss(crfpp_model_t *);
+  CRFPP_DLL_EXTERN size_t         crfpp_model_result_cache_eviction(crfpp_model_t *);
 
   CRFPP_DLL_EXTERN crfpp_t* crfpp_new(int,  char**);
   CRFPP_DLL_EXTERN crfpp_t* crfpp_new2(const char*);
   CRFPP_DLL_EXTERN void     crfpp_destroy(crfpp_t*);
   CRFPP_DLL_EXTERN int      crfpp_set_model(crfpp_t *, crfpp_model_t *);
   CRFPP_DLL_EXTERN int      crfpp_add2(crfpp_t*, size_t, const char **);
+  CRFPP_DLL_EXTERN int      crfpp_add_borrowed(crfpp_t*, size_t, const char **);
   CRFPP_DLL_EXTERN int      crfpp_add(crfpp_t*, const char*);
   CRFPP_DLL_EXTERN size_t   crfpp_size(crfpp_t*);
   CRFPP_DLL_EXTERN size_t   crfpp_xsize(crfpp_t*);
@@ -104,12 +111,26 @@ extern "C" {
                                                    size_t, char *, size_t);
   CRFPP_DLL_EXTERN const char*  crfpp_tostr(crfpp_t*);
   CRFPP_DLL_EXTERN const char*  crfpp_tostr2(crfpp_t*, char *, size_t);
+  CRFPP_DLL_EXTERN const char*  crfpp_tobin(crfpp_t*, size_t *);
+  CRFPP_DLL_EXTERN int          crfpp_to_array(crfpp_t*, unsigned short *,
+                                               float *, size_t);
 
   CRFPP_DLL_EXTERN void crfpp_set_vlevel(crfpp_t *, unsigned int);
   CRFPP_DLL_EXTERN unsigned int crfpp_vlevel(crfpp_t *);
   CRFPP_DLL_EXTERN void crfpp_set_cost_factor(crfpp_t *, float);
   CRFPP_DLL_EXTERN float crfpp_cost_factor(crfpp_t *);
   CRFPP_DLL_EXTERN void crfpp_set_nbest(crfpp_t *, size_t);
+  CRFPP_DLL_EXTERN void crfpp_set_beam(crfpp_t *, size_t);
+  CRFPP_DLL_EXTERN size_t crfpp_beam(crfpp_t *);
+  CRFPP_DLL_EXTERN void crfpp_set_beam_threshold(crfpp_t *, double);
+  CRFPP_DLL_EXTERN double crfpp_beam_threshold(crfpp_t *);
+  CRFPP_DLL_EXTERN void crfpp_set_marginal_level(crfpp_t *, unsigned int);
+  CRFPP_DLL_EXTERN unsigned int crfpp_marginal_level(crfpp_t *);
+  CRFPP_DLL_EXTERN size_t crfpp_unigram_cache_hit(crfpp_t *);
+  CRFPP_DLL_EXTERN size_t crfpp_unigram_cache_miss(crfpp_t *);
+  CRFPP_DLL_EXTERN size_t crfpp_result_cache_hit(crfpp_t *);
+  CRFPP_DLL_EXTERN size_t crfpp_result_cache_miss(crfpp_t *);
+  CRFPP_DLL_EXTERN size_t crfpp_result_cache_eviction(crfpp_t *);
 #endif
 
 #ifdef __cplusplus
@@ -151,6 +172,24 @@ class CRFPP_DLL_CLASS_EXTERN Model {
   // model object
   virtual Tagger *createTagger() const = 0;
 
+#ifndef SWIG
+  // tag |size| sentences at once with |thread_num| threads
+  // (0: the number of CPUs). input[i] is a sentence in the same format
+  // as Tagger::parse(const char *), and output[i] is set to its result.
+  // The results are valid until the next call of parseBatch().
+  virtual bool parseBatch(size_t size, const char **input,
+                          const char **output, size_t thread_num) = 0;
+#endif
+
+  // return the statistics of the sentence-level result cache shared by
+  // the taggers of this model (see --result-cache-size).
+  // When a sentence is served from the cache, only the tags, n-best
+  // paths and marginal probabilities are available; the lattice
+  // accessors (alpha, beta, emission_cost, next() beyond nbest) are not.
+  virtual size_t result_cache_hit() const = 0;
+  virtual size_t result_cache_miss() const = 0;
+  virtual size_t result_cache_eviction() const = 0;
+
   virtual const char* what() = 0;
 
   virtual ~Model() {}
@@ -169,6 +208,11 @@ class CRFPP_DLL_CLASS_EXTERN Tagger {
   // add str[] as tokens to the current context
   virtual bool add(size_t size, const char **str) = 0;
 
+  // same as add(size, str), but str[] is not copied. The caller must
+  // keep str[0..size-1] alive and unchanged until clear() is called
+  // (parse(const char *) and read() call clear() too).
+  virtual bool add_borrowed(size_t size, const char **str) = 0;
+
   // close the current model
   virtual void close() = 0;
 
@@ -197,6 +241,50 @@ class CRFPP_DLL_CLASS_EXTERN Tagger {
   // get nbest
   virtual size_t nbest() const = 0;
 
+  // set beam width: viterbi keeps the |beam| best tags of each token
+  // (0: all, exact search). Used only when nbest is 0 and no
+  // probability is computed (see set_marginal_level()).
+  virtual void set_beam(size_t beam) = 0;
+
+  // get beam width
+  virtual size_t beam() const = 0;
+
+  // set beam threshold: viterbi drops tags scoring more than |threshold|
+  // below the best of their token (0: no threshold).
+  virtual void set_beam_threshold(double threshold) = 0;
+
+  // get beam threshold
+  virtual double beam_threshold() const = 0;
+
+  // set the probabilities parse() computes besides the best path:
+  //   0: all of them by forward-backward if nbest > 0 or
+  //      vlevel >= 1, none otherwise (default)
+  //   1: prob() by the forward pass; the backward pass for prob(i),
+  //      prob(i, j) and beta() runs when one of them is first read,
+  //      e.g. to print at vlevel >= 1
+  //   2: all of them by forward-backward
+  // The marginals of the best path need the whole backward pass too,
+  // so they cost the same as the full table. Without any probability
+  // computed, prob(i) and prob(i, j) return 0.
+  virtual void set_marginal_level(unsigned int level) = 0;
+
+  // get marginal level
+  virtual unsigned int marginal_level() const = 0;
+
+  // return the number of hits/misses of the per-tagger cache of
+  // context-free unigram feature ids (see --unigram-cache-size).
+  // Expanded keys of 23 characters or more are never cached and always
+  // count as misses.
+  virtual size_t unigram_cache_hit() const = 0;
+  virtual size_t unigram_cache_miss() const = 0;
+
+  // return the statistics of the sentence-level result cache, which is
+  // owned by this tagger when it is opened with --result-cache-size and
+  // shared with the model after set_model().
+  virtual size_t result_cache_hit() const = 0;
+  virtual size_t result_cache_miss() const = 0;
+  virtual size_t result_cache_eviction() const = 0;
+
   // add one line to the current context
   virtual bool add(const char* str) = 0;
 
@@ -322,6 +410,30 @@ class CRFPP_DLL_CLASS_EXTERN Tagger {
   // size of the buffer. if failed, return NULL
   virtual const char* toString(char* result , size_t size) = 0;
 
+  // return parsed result as binary records, one per n-best path.
+  // 'size' is set to the length of the returned buffer.
+  // Each record, in native byte order, is
+  //   unsigned int   size()        number of tokens
+  //   unsigned short rank          n-best rank (0 for the best path)
+  //   unsigned short flags         1: prob, 2: marginals
+  //   float          prob()        if flags & 1 (verbose level >= 1)
+  //   unsigned short y(i)          size() tag ids
+  //   float          prob(i, j)    size() * ysize(), if flags & 2
+  //                                (verbose level >= 2)
+  virtual const char* toBinary(size_t *size) = 0;
+
+  // return the header of a stream of binary records: "CRFB", the
+  // format version and ysize() as unsigned int, and the NUL-terminated
+  // tag names.
+  virtual const char* binaryHeader(size_t *size) = 0;
+
+  // copy the tag ids of the current result to tags[0 .. size()-1].
+  // If 'marginals' is not NULL, also copy prob(i, j) to
+  // marginals[i * ysize() + j], which needs verbose level >= 1.
+  // 'size' is the number of elements of 'tags'. if failed, return false
+  virtual bool toArray(unsigned short *tags, float *marginals,
+                       size_t size) = 0;
+
   // parse 'str' and return parsed result.
   // You don't need to delete return value, but the buffer
   // is rewritten whenever you call parse method.
@@ -363,7 +475,8 @@ CRFPP_DLL_EXTERN Model *createModelFromArray(int argc, char **argv,
 // e.g. arg = "-m model -v3";
 CRFPP_DLL_EXTERN Model *createModel(const char *arg);
 
-// load model from [buf, buf+size].
+// load model from [buf, buf+size]. A cascade file given by -k must not
+// name a model with "model:" here.
 CRFPP_DLL_EXTERN Model *createModelFromArray(const char *arg,
                                              const char *model_buf,
                                              size_t model_size);
@@ -29,24 +29,6 @@
 namespace CRFPP {
 namespace {
 
-inline size_t getCpuCount() {
-  size_t result = 1;
-#if defined(_WIN32) && !defined(__CYGWIN__)
-  SYSTEM_INFO si;
-  ::GetSystemInfo(&si);
-  result = si.dwNumberOfProcessors;
-#else
-#ifdef HAVE_SYS_CONF_SC_NPROCESSORS_CONF
-  const long n = sysconf(_SC_NPROCESSORS_CONF);
-  if (n == -1) {
-    return 1;
-  }
-  result = static_cast<size_t>(n);
-#endif
-#endif
-  return result;
-}
-
 unsigned short getThreadSize(unsigned short size) {
     // 获取线程数
   if (size == 0) {  // 如果为0，就使用CPU和核数
@@ -315,7 +297,10 @@ bool Encoder::learn(const char *templfile, // 模板文件
                     double C,  // 压缩模型吗？
                     unsigned short thread_num, // 线程数
                     unsigned short shrinking_size,
-                    int algorithm) {
+                    int algorithm,
+                    size_t tag_dict_freq,
+                    const char *transition_file,
+                    bool observed_transitions) {
   std::cout << COPYRIGHT << std::endl;    // 版权字符串
 
 	// 参数检查
@@ -392,6 +377,18 @@ bool Encoder::learn(const char *templfile, // 模板文件
 	// 从特征函数字典中删除那些 出现频次 < freq 的特征函数
   feature_index.shrink(freq, &allocator);
 
+  if (tag_dict_freq > 0 &&
+      !feature_index.buildTagDictionary(x, tag_dict_freq)) {
+    WHAT_ERROR(feature_index.what());
+  }
+
+  if (observed_transitions) {
+    feature_index.buildTransitionTable(x);
+  } else if (transition_file && *transition_file &&
+             !feature_index.openTransitionTable(transition_file)) {
+    WHAT_ERROR(feature_index.what());
+  }
+
   std::vector <double> alpha(feature_index.size());  // 特征函数的权重参数列表
   std::fill(alpha.begin(), alpha.end(), 0.0);
   feature_index.set_alpha(&alpha[0]);  // 把特征函数的权重全部设置成 0
@@ -468,6 +465,14 @@ const CRFPP::Option long_options[] = {  // 可配置的输入参数列表
   {"algorithm",  'a', "CRF",   "(CRF|MIRA)", "select training algorithm" },
   {"thread", 'p',   "0",       "INT",
    "number of threads (default auto-detect)" },
+  {"tag-dictionary", 'D', "0", "INT",
+   "store the tags seen with each token that occurs no less than INT "
+   "times, to prune the lattice at decoding (default 0: off)" },
+  {"transitions", 'T', 0, "FILE",
+   "restrict decoding to the tag bigrams listed in FILE, one "
+   "\"prev next\" pair per line" },
+  {"observed-transitions", 'O', 0, 0,
+   "restrict decoding to the tag bigrams seen in the training data" },
   {"shrinking-size", 'H', "20", "INT",
    "set INT for number of iterations variable needs to "
    " be optimal before considered for shrinking. (default 20)" },
@@ -500,6 +505,10 @@ int crfpp_learn(const Param &param) {
       CRFPP::getThreadSize(param.get<unsigned short>("thread"));
   const unsigned short shrinking_size
       = param.get<unsigned short>("shrinking-size");
+  const size_t         tag_dict_freq  = param.get<int>("tag-dictionary");
+  const std::string    transitions    = param.get<std::string>("transitions");
+  const bool           observed_transitions =
+      param.get<bool>("observed-transitions");
   std::string salgo = param.get<std::string>("algorithm");  // 训练算法
 
   CRFPP::toLower(&salgo);
@@ -532,7 +541,8 @@ int crfpp_learn(const Param &param) {
                        // 下面是命令的控制参数
                        textmodel,
                        maxiter, freq, eta, C, thread, shrinking_size,
-                       algorithm)) {
+                       algorithm, tag_dict_freq, transitions.c_str(),
+                       observed_transitions)) {
       std::cerr << encoder.what() << std::endl;
       return -1;
     }
@@ -19,7 +19,8 @@ class Encoder {
              bool, size_t, size_t,
              double, double,
              unsigned short,
-             unsigned short, int);
+             unsigned short, int, size_t,
+             const char *, bool);
 
   bool convert(const char *text_file,
                const char* binary_file);
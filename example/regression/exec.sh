@@ -0,0 +1,26 @@
+#!/bin/sh
+# Checks of corner cases; stops at the first failure.
+
+fail() {
+  echo "FAILED: $1"
+  rm -f model model.txt model2 out out2
+  exit 1
+}
+
+# With only the observed transitions allowed, nbest.test has 4 paths;
+# asking for more must stop after them.
+../../crf_learn -O template nbest.train model > /dev/null || fail "crf_learn -O"
+../../crf_test -n 10 -v1 -m model nbest.test > out || fail "crf_test -n 10"
+test `grep -c '^# ' out` -eq 4 || fail "crf_test -n 10: wrong number of paths"
+
+# A model converted back from its text form tags the same; here no
+# token reaches the tag dictionary cutoff, which leaves it empty.
+../../crf_learn -t -D 100 template nbest.train model > /dev/null \
+  || fail "crf_learn -t -D 100"
+../../crf_learn -C model.txt model2 > /dev/null || fail "crf_learn -C"
+../../crf_test -v2 -m model nbest.test > out || fail "crf_test"
+../../crf_test -v2 -m model2 nbest.test > out2 || fail "crf_test"
+cmp -s out out2 || fail "crf_learn -C: the converted model differs"
+
+rm -f model model.txt model2 out out2
+echo "OK"
@@ -7,8 +7,6 @@
 //
 #include "feature_index.h"
 #include "common.h"
-#include "node.h"
-#include "path.h"
 #include "tagger.h"
 
 namespace CRFPP {
@@ -19,65 +17,110 @@ const char *BOS[kMaxContextSize] = { "_B-1", "_B-2", "_B-3", "_B-4",
 const char *EOS[kMaxContextSize] = { "_B+1", "_B+2", "_B+3", "_B+4",
                                      "_B+5", "_B+6", "_B+7", "_B+8" };
 
-const char *FeatureIndex::getIndex(const char *&p,
-                                   size_t pos,
-                                   const TaggerImpl &tagger) const {
-  if (*p++ !='[') {
-    return 0;
-  }
+namespace {
+const size_t kNoNode = static_cast<size_t>(-1);
 
-  int col = 0;
-  int row = 0;
+// parse "[row,col]" in %x[row,col]
+bool parseIndex(const char *&p, int *row, int *col) {
+  if (*p++ != '[') {
+    return false;
+  }
 
   int neg = 1;
-  if (*p++ == '-') {
+  if (*p == '-') {
     neg = -1;
-  } else {
-    --p;
-  }
-
-  for (; *p; ++p) {
-    switch (*p) {
-      case '0': case '1': case '2': case '3': case '4':
-      case '5': case '6': case '7': case '8': case '9':
-        row = 10 * row +(*p - '0');
-        break;
-      case ',':
-        ++p;
-        goto NEXT1;
-      default: return  0;
-    }
+    ++p;
   }
 
-NEXT1:
-
-  for (; *p; ++p) {
-    switch (*p) {
-      case '0': case '1': case '2': case '3': case '4':
-      case '5': case '6': case '7': case '8': case '9':
-        col = 10 * col + (*p - '0');
-        break;
-      case ']': goto NEXT2;
-      default: return 0;
-    }
+  *row = 0;
+  for (; *p >= '0' && *p <= '9'; ++p) {
+    *row = 10 * *row + (*p - '0');
+  }
+  if (*p++ != ',') {
+    return false;
   }
 
-NEXT2:
+  *col = 0;
+  for (; *p >= '0' && *p <= '9'; ++p) {
+    *col = 10 * *col + (*p - '0');
+  }
+  if (*p++ != ']') {
+    return false;
+  }
 
-  row *= neg;
+  *row *= neg;
+  return true;
+}
+}  // namespace
+
+bool FeatureIndex::compileRule(const char *p,
+                               std::vector<TemplateOp> *rule) const {
+  rule->clear();
+  while (*p) {
+    TemplateOp op;
+    op.row = 0;
+    op.col = -1;
+    if (*p == '%') {
+      if (*++p != 'x') {
+        return false;
+      }
+      ++p;
+      if (!parseIndex(p, &op.row, &op.col) ||
+          op.row < -static_cast<int>(kMaxContextSize) ||
+          op.row > static_cast<int>(kMaxContextSize) ||
+          op.col >= static_cast<int>(xsize_)) {
+        return false;
+      }
+    } else {
+      const char *begin = p;
+      while (*p && *p != '%') ++p;
+      op.str.assign(begin, p - begin);
+    }
+    rule->push_back(op);
+  }
+  return true;
+}
 
-  if (row < -static_cast<int>(kMaxContextSize) ||
-      row > static_cast<int>(kMaxContextSize) ||
-      col < 0 || col >= static_cast<int>(tagger.xsize())) {
-    return 0;
+bool FeatureIndex::compileTemplates() {
+  rules_.resize(unigram_templs_.size() + bigram_templs_.size());
+  for (size_t i = 0; i < rules_.size(); ++i) {
+    const std::string &templ = i < unigram_templs_.size() ?
+        unigram_templs_[i] : bigram_templs_[i - unigram_templs_.size()];
+    CHECK_FALSE(compileRule(templ.c_str(), &rules_[i]))
+        << "invalid template: " << templ;
+    // TODO(taku): very dirty workaround
+    if (check_max_xsize_) {
+      for (size_t j = 0; j < rules_[i].size(); ++j) {
+        max_xsize_ = std::max(max_xsize_,
+                              static_cast<unsigned int>(rules_[i][j].col + 1));
+      }
+    }
   }
 
-  // TODO(taku): very dirty workaround
-  if (check_max_xsize_) {
-    max_xsize_ = std::max(max_xsize_, static_cast<unsigned int>(col + 1));
+  // bigram rules without %x first, so that their ids are a common
+  // prefix of the bigram features of every position.
+  bigram_rules_.clear();
+  for (int pass = 0; pass < 2; ++pass) {
+    for (size_t i = unigram_templs_.size(); i < rules_.size(); ++i) {
+      bool has_index = false;
+      for (size_t j = 0; j < rules_[i].size(); ++j) {
+        has_index |= rules_[i][j].col >= 0;
+      }
+      if (has_index == (pass == 1)) {
+        bigram_rules_.push_back(i);
+      }
+    }
+    if (pass == 0) {
+      static_bigram_size_ = bigram_rules_.size();
+    }
   }
+  return true;
+}
 
-  const int idx = pos + row;
+const char *FeatureIndex::getIndex(const TemplateOp &op,
+                                   size_t pos,
+                                   const TaggerImpl &tagger) const {
+  const int idx = pos + op.row;
   if (idx < 0) {
     return BOS[-idx-1];
   }
@@ -85,150 +128,163 @@ NEXT2:
     return EOS[idx - tagger.size()];
   }
 
-  return tagger.x(idx, col);
+  return tagger.x(idx, op.col);
 }
 
 // 利用传入的特征模板，对传入的一句话作用一遍，生成特征函数
-bool FeatureIndex::applyRule(string_buffer *os,
-                             const char *p,
+void FeatureIndex::applyRule(string_buffer *os,
+                             const std::vector<TemplateOp> &rule,
                              size_t pos,
                              const TaggerImpl& tagger) const {
   os->assign("");  // clear
-  const char *r;
-
-  for (; *p; p++) {
-    switch (*p) {
-      default:
-        *os << *p;
-        break;
-      case '%':
-        switch (*++p) {
-          case 'x':
-            ++p;
-            r = getIndex(p, pos, tagger);
-            if (!r) {
-              return false;
-            }
-            *os << r;
-            break;
-          default:
-            return false;
-        }
-        break;
+  for (std::vector<TemplateOp>::const_iterator it = rule.begin();
+       it != rule.end(); ++it) {
+    if (it->col < 0) {
+      os->append(it->str);
+    } else {
+      os->append(getIndex(*it, pos, tagger));
     }
   }
-
-  *os << '\0';
-
-  return true;
 }
 
-void FeatureIndex::rebuildFeatures(TaggerImpl *tagger) const {
-	// 构建这个句子的篱笆图
-  size_t fid = tagger->feature_id();
-  const size_t thread_id = tagger->thread_id();
-
-  Allocator *allocator = tagger->allocator();
-  allocator->clear_freelist(thread_id);
-
-	// 这个句子对应的  "字"特征函数集 组成的集合
-  FeatureCache *feature_cache = allocator->feature_cache();
+int FeatureIndex::getFeatureID(string_buffer *os,
+                               size_t i,
+                               size_t pos,
+                               const TaggerImpl &tagger) const {
+  applyRule(os, rules_[i], pos, tagger);
+  return getID(os->c_str());
+}
 
-	// 对这个tagger 中的行进行逐个解析--创建node
+void DecoderFeatureIndex::initRules() {
+  prefix_node_.resize(rules_.size());
+  prefix_size_.resize(rules_.size());
+  unigram_col_.resize(rules_.size());
+  for (size_t i = 0; i < rules_.size(); ++i) {
+    // a unigram rule with a single %x[0,col] is context-free
+    unigram_col_[i] = -1;
+    size_t refs = 0;
+    for (size_t j = 0; j < rules_[i].size(); ++j) {
+      if (rules_[i][j].col >= 0) {
+        ++refs;
+        unigram_col_[i] = rules_[i][j].row == 0 ? rules_[i][j].col : -1;
+      }
+    }
+    if (i >= unigram_templs_.size() || refs != 1) {
+      unigram_col_[i] = -1;
+    }
 
-	// 外层循环  -- 对应 篱笆图中的x轴
-  for (size_t cur = 0; cur < tagger->size(); ++cur) {
-    const int *f = (*feature_cache)[fid++];  // 取出这个字对应的特征函数集合
-    for (size_t i = 0; i < y_.size(); ++i) {
-	    //内层循环，对应篱笆图中的y轴
-      Node *n = allocator->newNode(thread_id);  // 创建 node
-      n->clear();
-      n->x = cur; // 当前时刻的x轴偏移
-      n->y = i;  // 当前时刻对应的y轴偏移
-      n->fvector = f;  // 这个x(观测值)对应的每个y值(y轴上的节点)，都拿到这个字的所有特征函数集合
-      tagger->set_node(n, cur, i);  // 构建一句话的网络拓扑图
+    size_t node_pos = 0;
+    size_t key_pos = 0;
+    prefix_size_[i] = 0;
+    if (!rules_[i].empty() && rules_[i][0].col < 0) {
+      const std::string &prefix = rules_[i][0].str;
+      if (da_.traverse(prefix.data(), node_pos, key_pos,
+                       prefix.size()) == -2) {
+        node_pos = kNoNode;
+      }
+      prefix_size_[i] = 1;
     }
+    prefix_node_[i] = node_pos;
   }
+}
 
-	// 对这个tagger 中的行进行逐个解析--创建path
+int DecoderFeatureIndex::getFeatureID(string_buffer *,
+                                      size_t i,
+                                      size_t pos,
+                                      const TaggerImpl &tagger) const {
+  UnigramCache *cache = unigram_col_[i] >= 0 ?
+      tagger.allocator()->unigram_cache() : 0;
+  if (!cache) {
+    return lookupRule(i, pos, tagger);
+  }
 
-	// 外层循环  -- 对应 篱笆图中的x轴
-	for (size_t cur = 1; cur < tagger->size(); ++cur) {
-    const int *f = (*feature_cache)[fid++];
-    for (size_t j = 0; j < y_.size(); ++j) {
-	    //内层循环，对应 cur-1 处 的篱笆图中的y轴
+  int id = -1;
+  if (!cache->find(i, tagger.x(pos, unigram_col_[i]), &id)) {
+    id = lookupRule(i, pos, tagger);
+    cache->insert(id);
+  }
+  return id;
+}
 
-      for (size_t i = 0; i < y_.size(); ++i) {
-	      //内层循环，对应 cur 处 的篱笆图中的y轴
-        Path *p = allocator->newPath(thread_id);  // 创建 path
-        p->clear();
-	      // 添加节点
-        p->add(tagger->node(cur - 1, j),
-               tagger->node(cur,     i));
+// Same as applyRule() + getID(), but walks the double-array while the
+// template is being expanded, so that the feature string is never built
+// and unknown features are rejected as soon as the trie has no child.
+int DecoderFeatureIndex::lookupRule(size_t i,
+                                    size_t pos,
+                                    const TaggerImpl &tagger) const {
+  size_t node_pos = prefix_node_[i];
+  if (node_pos == kNoNode) {
+    return -1;
+  }
 
-	      // 把这个cur(x轴) 对应的字特征函数集，绑定到这个边上，方便使用
-        p->fvector = f;
-      }
+  const std::vector<TemplateOp> &rule = rules_[i];
+  for (size_t j = prefix_size_[i]; j < rule.size(); ++j) {
+    const char *r = 0;
+    size_t len = 0;
+    if (rule[j].col < 0) {
+      r = rule[j].str.data();
+      len = rule[j].str.size();
+    } else {
+      r = getIndex(rule[j], pos, tagger);
+      len = std::strlen(r);
+    }
+    size_t key_pos = 0;
+    if (len > 0 && da_.traverse(r, node_pos, key_pos, len) == -2) {
+      return -1;  // no such feature
     }
   }
+
+  size_t key_pos = 0;
+  const int n = da_.traverse("", node_pos, key_pos, 0);
+  return n >= 0 ? n : -1;
 }
 
 // 把特征函数字符串插入 特征字典中，然后返回在字典中的索引ID(pair对的第一个值)
-#define ADD { const int id = getID(os.c_str());         \
+#define ADD(i, cur) do {                                        \
+    const int id = getFeatureID(&os, (i), (cur), *tagger);     \
     if (id != -1) feature.push_back(id); } while (0)
 
 bool FeatureIndex::buildFeatures(TaggerImpl *tagger) const {
   // 构建特征函数，并把特征函数插入字典维护
   string_buffer os;
-  std::vector<int> feature;  // 存放的是本tagger(句子)，所生成的所有特征函数的索引ID
+  // 存放的是本tagger(句子)，所生成的所有特征函数的索引ID
+  std::vector<int> &feature = *tagger->allocator()->feature_buffer();
+  feature.clear();
 
   FeatureCache *feature_cache = tagger->allocator()->feature_cache();
   tagger->set_feature_id(feature_cache->size());  // 设置当前的feature id
 
-	// 应用U类模板 创建特征函数
-	// 对tagger(一句话)的每个训练行[the, DT, B]这样的，经历一遍所有的 模板行
-	std::cout<< "---------------" << std::endl;
+  // 应用U类模板 创建特征函数
+  // 对tagger(一句话)的每个训练行[the, DT, B]这样的，经历一遍所有的 模板行
+  const size_t usize = unigram_templs_.size();
   for (size_t cur = 0; cur < tagger->size(); ++cur) {
-    for (std::vector<std::string>::const_iterator it
-             = unigram_templs_.begin();
-         it != unigram_templs_.end(); ++it) {
-	    // it->c_str(), 一个个的模板   c_str：把常规字符串，转变成以空字符结尾的标准字符串
-      if (!applyRule(&os, it->c_str(), cur, *tagger)) {
-        return false;
-      }
-
-	    std::cout<< "本句话" << cur << "第个字(观测值)" << ": " << *tagger->x(cur) << "   " <<
-					    "所用模板是" << it->c_str()  << "   os应用模板后的特征是: " << os << std::endl;
-      ADD;
+    for (size_t i = 0; i < usize; ++i) {
+      ADD(i, cur);
     }
     feature_cache->add(feature);
     feature.clear();
   }
-//	for (std::vector<std::string>::const_iterator
-//					     it = bigram_templs_.begin();
-//	     it != bigram_templs_.end(); ++it) {
-//		std::cout <<"@@U" << *it << std::endl;
-//
-//	}
-	// 应用B类模板创建  特征函数
+
+  // 应用B类模板创建  特征函数
+  std::vector<int> static_feature;
   for (size_t cur = 1; cur < tagger->size(); ++cur) {
-    for (std::vector<std::string>::const_iterator
-             it = bigram_templs_.begin();
-         it != bigram_templs_.end(); ++it) {
-      if (!applyRule(&os, it->c_str(), cur, *tagger)) {
-        return false;
+    for (size_t i = 0; i < bigram_rules_.size(); ++i) {
+      if (cur == 1 && i == static_bigram_size_) {
+        static_feature = feature;
       }
-      ADD;
+      ADD(bigram_rules_[i], cur);
+    }
+    if (cur == 1 && bigram_rules_.size() == static_bigram_size_) {
+      static_feature = feature;
     }
     feature_cache->add(feature);
     feature.clear();
   }
-//	for (std::vector<std::string>::const_iterator
-//					     it = bigram_templs_.begin();
-//	     it != bigram_templs_.end(); ++it) {
-//		std::cout <<"@@U" << *it << std::endl;
-//
-//	}
+
+  // features of the position-independent bigram rules
+  if (tagger->size() > 0) {
+    feature_cache->add(static_feature);
+  }
 
   return true;
 }
@@ -6,6 +6,7 @@
 //  Copyright(C) 2005-2007 Taku Kudo <taku@chasen.org>
 //
 #include <algorithm>
+#include <cstring>
 #include "feature_cache.h"
 
 namespace CRFPP {
@@ -32,4 +33,55 @@ void FeatureCache::shrink(std::map<int, int> *old2new) {
   }
   return;
 }
+
+UnigramCache::UnigramCache(size_t size)
+    : mask_(0), last_(0), last_rule_(0), last_key_(0), last_size_(0),
+      hit_(0), miss_(0) {
+  size_t n = 1;
+  while (n < size) n <<= 1;
+  Entry e;
+  e.rule = static_cast<unsigned int>(-1);
+  e.id = -1;
+  e.key[0] = '\0';
+  table_.resize(n, e);
+  mask_ = n - 1;
+}
+
+bool UnigramCache::find(unsigned int rule, const char *key, int *id) {
+  // FNV-1a
+  unsigned int h = 2166136261U ^ rule;
+  size_t len = 0;
+  for (; key[len] != '\0'; ++len) {
+    if (len == kKeySize - 1) {
+      ++miss_;  // too long to cache; looked up every time
+      last_ = 0;
+      return false;
+    }
+    h = (h ^ static_cast<unsigned char>(key[len])) * 16777619U;
+  }
+
+  Entry *e = &table_[h & mask_];
+  if (e->rule == rule && std::memcmp(e->key, key, len + 1) == 0) {
+    ++hit_;
+    *id = e->id;
+    return true;
+  }
+
+  ++miss_;
+  last_ = e;
+  last_rule_ = rule;
+  last_key_ = key;
+  last_size_ = len;
+  return false;
+}
+
+void UnigramCache::insert(int id) {
+  if (!last_) {
+    return;
+  }
+  last_->rule = last_rule_;
+  last_->id = id;
+  std::memcpy(last_->key, last_key_, last_size_ + 1);
+  last_ = 0;
+}
 }
@@ -31,5 +31,39 @@ class FeatureCache: public std::vector <int *> {  // 特征函数的类表示
   FreeList<int> feature_freelist_;  // 存储的是： 本tagger中的 某个字 用到的特征函数ID
 		// 你要知道，一个句子中有多个字，每个字对应一个feature_freelist_(一对特征函数)
 };
+
+// Bounded, direct-mapped memo of (rule, token) -> feature id. Used by the
+// decoder for unigram rules that only refer to one column of the current
+// token, so that frequent tokens skip the double-array lookup.
+class UnigramCache {
+ public:
+  // return true and set |id| if (rule, key) is cached.
+  bool find(unsigned int rule, const char *key, int *id);
+  // store |id| for the (rule, key) passed to the last find().
+  void insert(int id);
+
+  size_t hit() const  { return hit_; }
+  size_t miss() const { return miss_; }  // includes uncached long keys
+
+  explicit UnigramCache(size_t size);
+  virtual ~UnigramCache() {}
+
+ private:
+  enum { kKeySize = 24 };  // longer tokens are not cached
+  struct Entry {
+    unsigned int rule;
+    int          id;
+    char         key[kKeySize];
+  };
+
+  std::vector<Entry> table_;
+  size_t             mask_;
+  Entry             *last_;  // slot of the last missed find()
+  unsigned int       last_rule_;
+  const char        *last_key_;
+  size_t             last_size_;
+  size_t             hit_;
+  size_t             miss_;
+};
 }
 #endif
@@ -11,9 +11,15 @@
 #include <set>
 #include "common.h"
 #include "feature_index.h"
+#include "tagger.h"
 
 namespace CRFPP {
 namespace {
+// Minor version flags of the optional sections that follow the
+// weights, in this order.
+const unsigned int kTagDictionaryVersion = 1;
+const unsigned int kTransitionTableVersion = 2;
+
 const char *read_ptr(const char **ptr, size_t size) {
   const char *r = *ptr;
   *ptr += size;
@@ -42,6 +48,148 @@ void make_templs(const std::vector<std::string> unigram_templs,
   // std::cout << templs << std::endl;
 
 }
+
+// Sum the weights of all features in |fvector| for |size| consecutive
+// labels, starting from |sum| if given. Sums are taken feature by
+// feature over a block of labels, so each label is accumulated in the
+// same order and precision (T) as when it is computed alone, and the
+// inner loop is a vector add of contiguous weights. The weights of the
+// next feature are prefetched meanwhile.
+// This is a macro so that every target below gets its own vectorized
+// copy.
+#define ADD_COST(T) do {                                                 \
+    const size_t kBlockSize = 256;                                      \
+    const size_t kLineSize = 64 / sizeof(T);                            \
+    T c[kBlockSize];                                                    \
+    for (size_t b = 0; b < size; b += kBlockSize) {                     \
+      const size_t n = std::min(size - b, kBlockSize);                  \
+      for (size_t i = 0; i < n; ++i) {                                  \
+        c[i] = sum ? static_cast<T>(sum[b + i]) : 0;                    \
+      }                                                                 \
+      for (const int *f = fvector; *f != -1; ++f) {                     \
+        if (f[1] != -1) {                                               \
+          const T *next = alpha + f[1] + b;                             \
+          for (size_t i = 0; i < n; i += kLineSize) {                   \
+            CRFPP_PREFETCH(next + i);                                   \
+          }                                                             \
+        }                                                               \
+        const T *a = alpha + *f + b;                                    \
+        for (size_t i = 0; i < n; ++i) {                                \
+          c[i] += a[i];                                                 \
+        }                                                               \
+      }                                                                 \
+      for (size_t i = 0; i < n; ++i) {                                  \
+        cost[b + i] = cost_factor * c[i];                               \
+      }                                                                 \
+    } } while (0)
+
+template <class T>
+void addCost(const T *alpha, const int *fvector, const double *sum,
+             double cost_factor, size_t size, double *cost) {
+  ADD_COST(T);
+}
+
+#ifdef CRFPP_USE_SIMD
+template <class T> CRFPP_TARGET_AVX2
+void addCostAVX2(const T *alpha, const int *fvector, const double *sum,
+                 double cost_factor, size_t size, double *cost) {
+  ADD_COST(T);
+}
+
+template <class T> CRFPP_TARGET_AVX512
+void addCostAVX512(const T *alpha, const int *fvector, const double *sum,
+                   double cost_factor, size_t size, double *cost) {
+  ADD_COST(T);
+}
+#endif
+#undef ADD_COST
+
+// the same sums for a fixed, small |size|, kept in registers
+template <class T, size_t N>
+void addCostFixed(const T *alpha, const int *fvector, const double *sum,
+                  double cost_factor, size_t, double *cost) {
+  T c[N];
+  for (size_t i = 0; i < N; ++i) {
+    c[i] = sum ? static_cast<T>(sum[i]) : 0;
+  }
+  for (const int *f = fvector; *f != -1; ++f) {
+    const T *a = alpha + *f;
+    for (size_t i = 0; i < N; ++i) {
+      c[i] += a[i];
+    }
+  }
+  for (size_t i = 0; i < N; ++i) {
+    cost[i] = cost_factor * c[i];
+  }
+}
+
+const size_t kMaxFixedSize = 9;
+
+template <class T>
+struct AddCost {
+  typedef void (*Func)(const T *alpha, const int *fvector, const double *sum,
+                       double cost_factor, size_t size, double *cost);
+
+  static Func select() {
+#ifdef CRFPP_USE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+      return &addCostAVX512<T>;
+    } else if (__builtin_cpu_supports("avx2")) {
+      return &addCostAVX2<T>;
+    }
+#endif
+    return &addCost<T>;
+  }
+};
+
+// cost kernels indexed by size, falling back to the generic one above
+// kMaxFixedSize. Emission rows have ysize values and transition rows
+// ysize^2, so small tag sets get unrolled sums.
+template <class T>
+class AddCostTable {
+ public:
+  typedef typename AddCost<T>::Func Func;
+
+  Func operator()(size_t size) const {
+    return size <= kMaxFixedSize ? table_[size] : generic_;
+  }
+
+  AddCostTable() : generic_(AddCost<T>::select()) {
+    table_[0] = table_[1] = generic_;
+    table_[2] = &addCostFixed<T, 2>;
+    table_[3] = &addCostFixed<T, 3>;
+    table_[4] = &addCostFixed<T, 4>;
+    table_[5] = &addCostFixed<T, 5>;
+    table_[6] = &addCostFixed<T, 6>;
+    table_[7] = &addCostFixed<T, 7>;
+    table_[8] = &addCostFixed<T, 8>;
+    table_[9] = &addCostFixed<T, 9>;
+  }
+
+ private:
+  Func generic_;
+  Func table_[kMaxFixedSize + 1];
+};
+
+// chosen once when the library is loaded
+const AddCostTable<float>  kAddCostFloat;
+const AddCostTable<double> kAddCostDouble;
+
+// addCost() of the cells listed in |tags| only
+template <class T>
+void addCostSparse(const T *alpha, const int *fvector,
+                   const unsigned short *tags, size_t n,
+                   double cost_factor, double *cost) {
+  for (size_t t = 0; t < n; ++t) {
+    const size_t j = tags[t];
+    T c = 0;
+    for (const int *f = fvector; *f != -1; ++f) {
+      c += alpha[*f + j];
+    }
+    cost[j] = cost_factor * c;
+  }
+}
 }  // namespace
 
 char *Allocator::strdup(const char *p) {  // 拷贝一个新的字符串
@@ -55,57 +203,49 @@ char *Allocator::strdup(const char *p) {  // 拷贝一个新的字符串
 Allocator::Allocator(size_t thread_num)  // 负责各种内存管理
     : thread_num_(thread_num),
       feature_cache_(new FeatureCache),
-      char_freelist_(new FreeList<char>(8192)) {
-  init();
-}
+      char_freelist_(new FreeList<char>(8192)),
+      lattice_(new Lattice[thread_num]) {}
 
 // 重写这个类的构造函数
 Allocator::Allocator()
     : thread_num_(1),
       feature_cache_(new FeatureCache),
-      char_freelist_(new FreeList<char>(8192)) {
-  init();
-}
+      char_freelist_(new FreeList<char>(8192)),
+      lattice_(new Lattice[1]) {}
 
 Allocator::~Allocator() {}
 
-Path *Allocator::newPath(size_t thread_id) {
-  return path_freelist_[thread_id].alloc();
-}
-
-Node *Allocator::newNode(size_t thread_id) {
-  return node_freelist_[thread_id].alloc();
-}
-
 void Allocator::clear() {
   feature_cache_->clear();
   char_freelist_->free();
-  for (size_t i = 0; i < thread_num_; ++i) {
-    path_freelist_[i].free();
-    node_freelist_[i].free();
-  }
 }
 
-void Allocator::clear_freelist(size_t thread_id) {
-  path_freelist_[thread_id].free();
-  node_freelist_[thread_id].free();
+Lattice *Allocator::lattice(size_t thread_id) const {
+  return &lattice_[thread_id];
 }
 
 FeatureCache *Allocator::feature_cache() const {
   return feature_cache_.get();
 }
 
-size_t Allocator::thread_num() const {
-  return thread_num_;
+std::vector<int> *Allocator::feature_buffer() {
+  return &feature_buffer_;
 }
 
-void Allocator::init() {
-  path_freelist_.reset(new FreeList<Path> [thread_num_]);
-  node_freelist_.reset(new FreeList<Node> [thread_num_]);
-  for (size_t i = 0; i < thread_num_; ++i) {
-    path_freelist_[i].set_size(8192 * 16);
-    node_freelist_[i].set_size(8192);
-  }
+std::vector<const char *> *Allocator::column_buffer() {
+  return &column_buffer_;
+}
+
+UnigramCache *Allocator::unigram_cache() const {
+  return unigram_cache_.get();
+}
+
+void Allocator::set_unigram_cache_size(size_t size) {
+  unigram_cache_.reset(size > 0 ? new UnigramCache(size) : 0);
+}
+
+size_t Allocator::thread_num() const {
+  return thread_num_;
 }
 
 // 解码阶段使用
@@ -139,7 +279,8 @@ bool EncoderFeatureIndex::open(const char *template_filename,
                                const char *train_filename) {
   check_max_xsize_ = true;
     // 逐行解析  模板文件    训练文件
-  return openTemplate(template_filename) && openTagSet(train_filename);
+  return openTemplate(template_filename) && openTagSet(train_filename) &&
+      compileTemplates();
 }
 
 bool EncoderFeatureIndex::openTemplate(const char *filename) {
@@ -264,12 +405,46 @@ bool DecoderFeatureIndex::openFromArray(const char *ptr, size_t size) {
 
   make_templs(unigram_templs_, bigram_templs_, &templs_);
 
+  if (!compileTemplates()) {
+    return false;
+  }
+
   da_.set_array(const_cast<char *>(ptr));
   ptr += dsize;
+  initRules();
 
   alpha_float_ = reinterpret_cast<const float *>(ptr);
   ptr += sizeof(alpha_float_[0]) * maxid_;
 
+  if (version_ % 100 & kTagDictionaryVersion) {
+    unsigned int tag_dsize = 0;
+    unsigned int tag_list_size = 0;
+    read_static<unsigned int>(&ptr, &tag_dsize);
+    read_static<unsigned int>(&ptr, &tag_list_size);
+    tag_da_.set_array(const_cast<char *>(ptr));
+    ptr += tag_dsize;
+    tag_list_ = reinterpret_cast<const unsigned short *>(ptr);
+    ptr += sizeof(tag_list_[0]) * tag_list_size;
+    if (tag_list_size % 2 != 0) {
+      ptr += sizeof(tag_list_[0]);  // padding
+    }
+  }
+
+  if (version_ % 100 & kTransitionTableVersion) {
+    unsigned int size = 0;
+    read_static<unsigned int>(&ptr, &size);
+    std::vector<char> allowed(y_.size() * y_.size(), 0);
+    for (unsigned int i = 0; i < size; ++i) {
+      unsigned short bigram[2];
+      read_static<unsigned short>(&ptr, &bigram[0]);
+      read_static<unsigned short>(&ptr, &bigram[1]);
+      CHECK_FALSE(bigram[0] < y_.size() && bigram[1] < y_.size())
+          << "model file is broken.";
+      allowed[bigram[0] * y_.size() + bigram[1]] = 1;
+    }
+    transition_table_.set(y_.size(), allowed);
+  }
+
   CHECK_FALSE(ptr == end) << "model file is broken.";
 
   return true;
@@ -311,10 +486,17 @@ bool EncoderFeatureIndex::convert(const char *text_filename,
 
   y_.clear();
   dic_.clear();
+  tag_dic_.clear();
   unigram_templs_.clear();
   bigram_templs_.clear();
   xsize_ = 0;
   maxid_ = 0;
+  // the sections of these headers are read even if they are empty
+  bool has_tag_dic = false;
+  bool has_transitions = false;
+  size_t tag_dic_size = 0;
+  size_t transition_size = 0;
+  transition_table_ = TransitionTable();
 
   CHECK_FALSE(ifs) << "open failed: " << text_filename;
 
@@ -341,6 +523,16 @@ bool EncoderFeatureIndex::convert(const char *text_filename,
     if (std::strcmp(column[0], "maxid:") == 0) {
       maxid_ = std::atoi(column[1]);
     }
+
+    if (std::strcmp(column[0], "tag-dictionary:") == 0) {
+      has_tag_dic = true;
+      tag_dic_size = std::atoi(column[1]);
+    }
+
+    if (std::strcmp(column[0], "transitions:") == 0) {
+      has_transitions = true;
+      transition_size = std::atoi(column[1]);
+    }
   }
 
   CHECK_FALSE(maxid_ > 0) << "maxid is not defined: " << text_filename;
@@ -388,6 +580,43 @@ bool EncoderFeatureIndex::convert(const char *text_filename,
                                 static_cast<unsigned int>(1))));
   }
 
+  if (has_tag_dic) {
+    std::map<std::string, unsigned short> tag_id;
+    for (size_t i = 0; i < y_.size(); ++i) {
+      tag_id[y_[i]] = static_cast<unsigned short>(i);
+    }
+    std::vector<char *> tags(y_.size() + 1);
+    while (true) {
+      CHECK_FALSE(ifs.getline(line.get(), line.size()))
+          << "format error: " << text_filename;
+      if (std::strlen(line.get()) == 0) {
+        break;
+      }
+      const size_t size = tokenize(line.get(), "\t ", &tags[0], tags.size());
+      CHECK_FALSE(size >= 2) << "format error: " << text_filename;
+      std::vector<unsigned short> &allowed = tag_dic_[tags[0]];
+      for (size_t i = 1; i < size; ++i) {
+        std::map<std::string, unsigned short>::const_iterator it =
+            tag_id.find(tags[i]);
+        CHECK_FALSE(it != tag_id.end())
+            << "unknown tag: " << tags[i] << " " << text_filename;
+        allowed.push_back(it->second);
+      }
+    }
+    CHECK_FALSE(tag_dic_.size() == tag_dic_size)
+        << " file is broken: " << text_filename;
+    if (!compileTagDictionary()) {
+      return false;
+    }
+  }
+
+  if (has_transitions) {
+    CHECK_FALSE(readTransitionTable(&ifs, text_filename))
+        << " file is broken: " << text_filename;
+    CHECK_FALSE(transition_table_.size() == transition_size)
+        << " file is broken: " << text_filename;
+  }
+
   std::vector<double> alpha;
   while (ifs.getline(line.get(), line.size())) {
     alpha.push_back(std::atof(line.get()));
@@ -445,6 +674,12 @@ bool EncoderFeatureIndex::save(const char *filename,
   CHECK_FALSE(bofs) << "open failed: " << filename;
 
   unsigned int version_ = version;
+  if (tag_list_) {
+    version_ += kTagDictionaryVersion;
+  }
+  if (transition_table()) {
+    version_ += kTransitionTableVersion;
+  }
   bofs.write(reinterpret_cast<char *>(&version_), sizeof(unsigned int));
 
   int type = 0;
@@ -471,6 +706,35 @@ bool EncoderFeatureIndex::save(const char *filename,
     bofs.write(reinterpret_cast<char *>(&alpha), sizeof(alpha));
   }
 
+  if (tag_list_) {
+    unsigned int tag_dsize = tag_da_.unit_size() * tag_da_.size();
+    unsigned int tag_list_size = tag_list_buffer_.size();
+    bofs.write(reinterpret_cast<char *>(&tag_dsize), sizeof(tag_dsize));
+    bofs.write(reinterpret_cast<char *>(&tag_list_size),
+               sizeof(tag_list_size));
+    bofs.write(reinterpret_cast<const char *>(tag_da_.array()), tag_dsize);
+    bofs.write(reinterpret_cast<const char *>(&tag_list_buffer_[0]),
+               sizeof(tag_list_buffer_[0]) * tag_list_size);
+    if (tag_list_size % 2 != 0) {
+      const unsigned short padding = 0;
+      bofs.write(reinterpret_cast<const char *>(&padding), sizeof(padding));
+    }
+  }
+
+  if (transition_table()) {
+    unsigned int size = transition_table_.size();
+    bofs.write(reinterpret_cast<char *>(&size), sizeof(size));
+    for (size_t k = 0; k < y_.size(); ++k) {
+      const unsigned short *succ = transition_table_.succ(k);
+      for (size_t i = 0; i < transition_table_.succ_size(k); ++i) {
+        unsigned short bigram[2];
+        bigram[0] = static_cast<unsigned short>(k);
+        bigram[1] = succ[i];
+        bofs.write(reinterpret_cast<char *>(bigram), sizeof(bigram));
+      }
+    }
+  }
+
   bofs.close();
 
   if (textmodelfile) {
@@ -486,6 +750,12 @@ bool EncoderFeatureIndex::save(const char *filename,
     tofs << "cost-factor: " << cost_factor_ << std::endl;
     tofs << "maxid: "       << maxid_ << std::endl;
     tofs << "xsize: "       << xsize_ << std::endl;
+    if (tag_list_) {
+      tofs << "tag-dictionary: " << tag_dic_.size() << std::endl;
+    }
+    if (transition_table()) {
+      tofs << "transitions: " << transition_table_.size() << std::endl;
+    }
 
     tofs << std::endl;
 
@@ -516,6 +786,30 @@ bool EncoderFeatureIndex::save(const char *filename,
 
     tofs << std::endl;
 
+    // tag dictionary
+    if (tag_list_) {
+      for (std::map<std::string, std::vector<unsigned short> >::iterator
+               it = tag_dic_.begin(); it != tag_dic_.end(); ++it) {
+        tofs << it->first;
+        for (size_t i = 0; i < it->second.size(); ++i) {
+          tofs << ' ' << y_[it->second[i]];
+        }
+        tofs << std::endl;
+      }
+      tofs << std::endl;
+    }
+
+    // allowed tag bigrams
+    if (transition_table()) {
+      for (size_t k = 0; k < y_.size(); ++k) {
+        const unsigned short *succ = transition_table_.succ(k);
+        for (size_t i = 0; i < transition_table_.succ_size(k); ++i) {
+          tofs << y_[k] << ' ' << y_[succ[i]] << std::endl;
+        }
+      }
+      tofs << std::endl;
+    }
+
     tofs.setf(std::ios::fixed, std::ios::floatfield);
     tofs.precision(16);
 
@@ -527,57 +821,156 @@ bool EncoderFeatureIndex::save(const char *filename,
   return true;
 }
 
-const char *FeatureIndex::getTemplate() const {
-  return templs_.c_str();
+bool EncoderFeatureIndex::buildTagDictionary(
+    const std::vector<TaggerImpl *> &x, size_t freq) {
+  std::map<std::string, std::pair<size_t, std::set<unsigned short> > > dic;
+  for (size_t i = 0; i < x.size(); ++i) {
+    for (size_t j = 0; j < x[i]->size(); ++j) {
+      std::pair<size_t, std::set<unsigned short> > &entry =
+          dic[x[i]->x(j, 0)];
+      ++entry.first;
+      entry.second.insert(static_cast<unsigned short>(x[i]->answer(j)));
+    }
+  }
+
+  // Frequent tokens seen with every tag gain nothing from an entry.
+  tag_dic_.clear();
+  for (std::map<std::string,
+           std::pair<size_t, std::set<unsigned short> > >::const_iterator
+           it = dic.begin(); it != dic.end(); ++it) {
+    if (it->second.first >= freq && it->second.second.size() < y_.size()) {
+      tag_dic_[it->first].assign(it->second.second.begin(),
+                                 it->second.second.end());
+    }
+  }
+
+  return compileTagDictionary();
+}
+
+bool EncoderFeatureIndex::compileTagDictionary() {
+  std::vector<const char *> key;
+  std::vector<int> val;
+  tag_list_buffer_.clear();
+  for (std::map<std::string, std::vector<unsigned short> >::const_iterator
+           it = tag_dic_.begin(); it != tag_dic_.end(); ++it) {
+    key.push_back(it->first.c_str());
+    val.push_back(static_cast<int>(tag_list_buffer_.size()));
+    tag_list_buffer_.push_back(static_cast<unsigned short>(it->second.size()));
+    tag_list_buffer_.insert(tag_list_buffer_.end(),
+                            it->second.begin(), it->second.end());
+  }
+
+  // keep an empty dictionary valid, so that the model still says it has one
+  if (key.empty()) {
+    key.push_back("");
+    val.push_back(0);
+    tag_list_buffer_.push_back(0);
+  }
+
+  CHECK_FALSE(tag_da_.build(key.size(), const_cast<char **>(&key[0]), 0,
+                            &val[0]) == 0)
+      << "cannot build double-array";
+  tag_list_ = &tag_list_buffer_[0];
+  return true;
 }
 
-void FeatureIndex::calcCost(Node *n) const {
-	// 计算 状态特征函数(点)  的代价
-  n->cost = 0.0;  // 代价清零
+void EncoderFeatureIndex::buildTransitionTable(
+    const std::vector<TaggerImpl *> &x) {
+  const size_t Y = y_.size();
+  std::vector<char> allowed(Y * Y, 0);
+  for (size_t i = 0; i < x.size(); ++i) {
+    for (size_t j = 1; j < x[i]->size(); ++j) {
+      allowed[x[i]->answer(j - 1) * Y + x[i]->answer(j)] = 1;
+    }
+  }
+  transition_table_.set(Y, allowed);
+}
+
+bool FeatureIndex::openTransitionTable(const char *filename) {
+  std::ifstream ifs(WPATH(filename));
+  CHECK_FALSE(ifs) << "open failed: " << filename;
+  return readTransitionTable(&ifs, filename);
+}
+
+bool FeatureIndex::readTransitionTable(std::istream *is,
+                                       const char *filename) {
+  std::map<std::string, size_t> tag_id;
+  for (size_t i = 0; i < y_.size(); ++i) {
+    tag_id[y_[i]] = i;
+  }
 
+  std::vector<char> allowed(y_.size() * y_.size(), 0);
+  scoped_fixed_array<char, 8192> line;
+  char *column[3];
+  while (is->getline(line.get(), line.size())) {
+    if (std::strlen(line.get()) == 0) {
+      break;
+    }
+    CHECK_FALSE(tokenize(line.get(), "\t ", column, 3) == 2)
+        << "format error: " << filename;
+    std::map<std::string, size_t>::const_iterator prev =
+        tag_id.find(column[0]);
+    std::map<std::string, size_t>::const_iterator next =
+        tag_id.find(column[1]);
+    CHECK_FALSE(prev != tag_id.end() && next != tag_id.end())
+        << "unknown tag: " << line.get() << " " << filename;
+    allowed[prev->second * y_.size() + next->second] = 1;
+  }
+  transition_table_.set(y_.size(), allowed);
+  return true;
+}
 
+const unsigned short *FeatureIndex::allowedTags(const char *token,
+                                                size_t *size) const {
+  if (!tag_list_) {
+    return 0;
+  }
+  const int id = tag_da_.exactMatchSearch<Darts::DoubleArray::result_type>(
+      token);
+  if (id < 0 || tag_list_[id] == 0) {
+    return 0;
+  }
+  *size = tag_list_[id];
+  return tag_list_ + id + 1;
+}
+
+const char *FeatureIndex::getTemplate() const {
+  return templs_.c_str();
+}
+
+void FeatureIndex::calcCost(const int *fvector, size_t size,
+                            double *cost) const {
 	// 计算 cost_factor_*∑(w*f)
-#define ADD_COST(T, A)                                                  \
-  do { T c = 0;                                                               \
-    for (const int *f = n->fvector; *f != -1; ++f) { c += (A)[*f + n->y];  }  \
-    n->cost =cost_factor_ *(T)c; } while (0)
-	// 解释：
-	// f: 改字的特征函数集合(不完整特征)的数组头部
-	// n->y: 这个节点的输出状态值（是index值），所以这里可以*f + n->y 这样相加来进行偏移
-	// A: alpha_:这是真正特征函数的权值向量:
-	// !!一定要知道真正的特征函数个数 = 不完整特征个数 * len(状态)!!
-
-	// c += (A)[*f + n->y] 你一定很好奇：这里看起来不像  w(权重)*f(特征函数)啊!!
-	// 其实(A)[*f + n->y]仅仅是权重w, 但是因为f,要么是0,要么是1，所以这个作者直接就合并在了
-	// 权重w上.
+  // the weight itself is the score since each feature fires as 1
+  calcCost(fvector, 0, size, cost);
+}
 
+void FeatureIndex::sumCost(const int *fvector, size_t size,
+                           double *sum) const {
+  // T fits in a double, so the partial sums are exact.
   if (alpha_float_) {
-    ADD_COST(float,  alpha_float_);
+    kAddCostFloat(size)(alpha_float_, fvector, 0, 1.0, size, sum);
   } else {
-    ADD_COST(double, alpha_);
+    kAddCostDouble(size)(alpha_, fvector, 0, 1.0, size, sum);
   }
-#undef ADD_COST
 }
 
-void FeatureIndex::calcCost(Path *p) const {
-	// 计算 转移特征函数(边) 的代价
-  p->cost = 0.0;
-
-	// cost_factor_*∑(w*f)
-#define ADD_COST(T, A)                                          \
-  { T c = 0.0;                                                  \
-    for (const int *f = p->fvector; *f != -1; ++f) {            \
-      c += (A)[*f + p->lnode->y * y_.size() + p->rnode->y];     \
-    }                                                           \
-    p->cost =cost_factor_*(T)c; }
+void FeatureIndex::calcCost(const int *fvector, const double *sum,
+                            size_t size, double *cost) const {
+  if (alpha_float_) {
+    kAddCostFloat(size)(alpha_float_, fvector, sum, cost_factor_, size, cost);
+  } else {
+    kAddCostDouble(size)(alpha_, fvector, sum, cost_factor_, size, cost);
+  }
+}
 
-	// 解释：(A)[*f + p->lnode->y * y_.size() + p->rnode->y] 代表这个边的权重
-	// *f + p->lnode->y * y_.size() + p->rnode->y  代表这个边的权重所在的index
+void FeatureIndex::calcSparseCost(const int *fvector,
+                                  const unsigned short *tags,
+                                  size_t n, double *cost) const {
   if (alpha_float_) {
-    ADD_COST(float,  alpha_float_);
+    addCostSparse(alpha_float_, fvector, tags, n, cost_factor_, cost);
   } else {
-    ADD_COST(double, alpha_);
+    addCostSparse(alpha_, fvector, tags, n, cost_factor_, cost);
   }
 }
-#undef ADD_COST
 }
@@ -14,8 +14,7 @@
 #include "common.h"
 #include "scoped_ptr.h"
 #include "feature_cache.h"
-#include "path.h"
-#include "node.h"
+#include "lattice.h"
 #include "freelist.h"
 #include "mmap.h"
 #include "darts.h"
@@ -23,6 +22,14 @@
 namespace CRFPP {
 class TaggerImpl;
 
+// One step of a compiled feature template: either a literal span or a
+// %x[row,col] reference.
+struct TemplateOp {
+  int         row;
+  int         col;  // -1 for a literal span
+  std::string str;
+};
+
 class Allocator {  // 这边定义了一个模板类，后面会不断的重写它  (用于内存管理)
  public:
   explicit Allocator(size_t thread_num);
@@ -30,21 +37,27 @@ class Allocator {  // 这边定义了一个模板类，后面会不断的重写
   virtual ~Allocator();
 
   char *strdup(const char *str);
-  Path *newPath(size_t thread_id); // 为指定的线程创建 path
-  Node *newNode(size_t thread_id); // 为指定的线程创建 node
   void clear();  // 清理内存
-  void clear_freelist(size_t thread_id);  // 清理某个线程的内存
+  // lattice shared by the taggers of one thread.
+  Lattice *lattice(size_t thread_id) const;
   FeatureCache *feature_cache() const;  // 返回 缓存的feature
+  // scratch for the feature ids of one token, reused across sentences.
+  std::vector<int> *feature_buffer();
+  // scratch for the columns of one input line.
+  std::vector<const char *> *column_buffer();
+  // per-tagger unigram feature id cache, or 0 if disabled.
+  UnigramCache *unigram_cache() const;
+  void set_unigram_cache_size(size_t size);
   size_t thread_num() const;
 
  private:
-  void init();
-
   size_t                       thread_num_;
   scoped_ptr<FeatureCache>     feature_cache_;  // 这个句子的 "字"特征函数集 的 集合
+  scoped_ptr<UnigramCache>     unigram_cache_;
+  std::vector<int>             feature_buffer_;
+  std::vector<const char *>    column_buffer_;
   scoped_ptr<FreeList<char> >  char_freelist_;
-  scoped_array< FreeList<Path> > path_freelist_; // 这个句子 构建的 path 列表
-  scoped_array< FreeList<Node> > node_freelist_;  // 这个句子构建的 node 列表
+  scoped_array<Lattice>        lattice_;
 };
 
 class FeatureIndex {  // template 的基类
@@ -55,6 +68,7 @@ class FeatureIndex {  // template 的基类
   size_t xsize() const { return xsize_; }  // 返回 讯训练文件的列数
   size_t ysize() const { return y_.size(); }  // 返回 状态集合的len
   const char* y(size_t i) const { return y_[i].c_str(); }
+  const std::string &ystr(size_t i) const { return y_[i]; }
 	// 设置 特征函数的权重
 	void   set_alpha(const double *alpha) { alpha_ = alpha; }
   const float *alpha_float() { return alpha_float_; }
@@ -62,35 +76,75 @@ class FeatureIndex {  // template 的基类
   void set_cost_factor(double cost_factor) { cost_factor_ = cost_factor; }
   double cost_factor() const { return cost_factor_; }
 
-	// 代价计算函数 --两个重载
-  void calcCost(Node *node) const;
-  void calcCost(Path *path) const;
+	// 代价计算函数
+  // cost[i] = cost_factor * sum of weight[*f + i] over the features f in
+  // |fvector|, for i < size. size is ysize() for emissions and ysize()^2
+  // for transitions.
+  void calcCost(const int *fvector, size_t size, double *cost) const;
+  // weight sums of |fvector| without cost_factor, to be passed to the
+  // calcCost() below.
+  void sumCost(const int *fvector, size_t size, double *sum) const;
+  // same as calcCost(), but starts from |sum| taken by sumCost() over
+  // the features preceding |fvector|.
+  void calcCost(const int *fvector, const double *sum,
+                size_t size, double *cost) const;
+  // calcCost() of the |n| emission cells listed in |tags| only.
+  void calcSparseCost(const int *fvector, const unsigned short *tags,
+                      size_t n, double *cost) const;
+
+  // tags seen with |token| (the first column) in the training data, in
+  // ascending order, or 0 if every tag is allowed: the model has no tag
+  // dictionary, or the token is rare or unknown.
+  const unsigned short *allowedTags(const char *token, size_t *size) const;
+  bool has_tag_dictionary() const { return tag_list_ != 0; }
+
+  // allowed tag bigrams for decoding, or 0 if all are allowed
+  const TransitionTable *transition_table() const {
+    return transition_table_.ysize() ? &transition_table_ : 0;
+  }
+  // replace the allowed bigrams with those listed in |filename|, one
+  // "previous-tag next-tag" pair per line.
+  bool openTransitionTable(const char *filename);
+
+  // true if no bigram rule refers to the input, i.e. the transition
+  // costs of a sentence are the same at every position.
+  bool static_bigram() const {
+    return static_bigram_size_ == bigram_rules_.size();
+  }
 
 	// 构建特征函数，并把特征函数插入字典维护
 	// 虚函数
   bool buildFeatures(TaggerImpl *tagger) const;
 
-	// 	构建网络
-  void rebuildFeatures(TaggerImpl *tagger) const;
-
   const char* what() { return what_.str(); }
 
 	// 构造函数
   explicit FeatureIndex(): maxid_(0), alpha_(0), alpha_float_(0),
                            cost_factor_(1.0), xsize_(0),
-                           check_max_xsize_(false), max_xsize_(0) {}
+                           check_max_xsize_(false), max_xsize_(0),
+                           static_bigram_size_(0), tag_list_(0) {}
   virtual ~FeatureIndex() {}
 
   const char *getTemplate() const;
 
  protected:
   virtual int getID(const char *str) const = 0;
-  const char *getIndex(const char *&p,
+  // compile unigram_templs_ and bigram_templs_ into rules_.
+  bool compileTemplates();
+  bool readTransitionTable(std::istream *is, const char *filename);
+  bool compileRule(const char *pattern, std::vector<TemplateOp> *rule) const;
+  const char *getIndex(const TemplateOp &op,
                        size_t pos,
                        const TaggerImpl &tagger) const;
-  bool applyRule(string_buffer *os,
-                 const char *pattern,
+  void applyRule(string_buffer *os,
+                 const std::vector<TemplateOp> &rule,
                  size_t pos, const TaggerImpl &tagger) const;
+  // expand the i-th rule at |pos| and return the id of the resulting
+  // feature, or -1 if the feature is unknown.
+  virtual int getFeatureID(string_buffer *os,
+                           size_t i,
+                           size_t pos,
+                           const TaggerImpl &tagger) const;
 
   mutable unsigned int      maxid_;  // 生成的特征的个数,也就是最大的特征函数ID-index
   const double             *alpha_; // 特征函数的权重列表， 里面的每个权重值，就是公式里的 w
@@ -101,8 +155,19 @@ class FeatureIndex {  // template 的基类
   mutable unsigned int      max_xsize_;
   std::vector<std::string>  unigram_templs_;  // 存储U类模板规则的列表，每行相当于一个元素
   std::vector<std::string>  bigram_templs_;  // 存储B类模板规则的列表
+  // compiled unigram templates followed by compiled bigram templates
+  std::vector<std::vector<TemplateOp> > rules_;
+  // indices of the bigram rules in rules_, the first static_bigram_size_
+  // of which have no %x.
+  std::vector<size_t>       bigram_rules_;
+  size_t                    static_bigram_size_;
   std::vector<std::string>  y_;  // 去重后的状态标记集合
   std::string               templs_;  // 模板文件中的规则，拼成一个大字符串
+  // tag dictionary: tokens mapped to offsets into tag_list_, where each
+  // entry is the number of tags followed by the tags.
+  Darts::DoubleArray        tag_da_;
+  const unsigned short     *tag_list_;
+  TransitionTable           transition_table_;
   whatlog                   what_;
 };
 
@@ -115,11 +180,21 @@ class EncoderFeatureIndex: public FeatureIndex {
   bool convert(const char *text_filename,
                const char *binary_filename);
   void shrink(size_t freq, Allocator *allocator);
+  // build the tag dictionary from the answers of |x|, keeping the
+  // tokens that occur at least |freq| times.
+  bool buildTagDictionary(const std::vector<TaggerImpl *> &x, size_t freq);
+  // allow only the tag bigrams of the answers of |x|
+  void buildTransitionTable(const std::vector<TaggerImpl *> &x);
 
  private:
   int getID(const char *str) const;
   bool openTemplate(const char *filename);
   bool openTagSet(const char *filename);
+  // fill tag_da_ and tag_list_ from tag_dic_
+  bool compileTagDictionary();
+
+  std::map<std::string, std::vector<unsigned short> > tag_dic_;
+  std::vector<unsigned short> tag_list_buffer_;
 
 	// <特征函数字符串，< 索引序列号(从0递增)，该特征的出现次数> >，所有生成的特征函数都放在这里
 	// 特征函数字符串 : U05:毎/日/新, 就是这样产生的特征函数
@@ -136,7 +211,19 @@ class DecoderFeatureIndex: public FeatureIndex {
  private:
   Mmap <char> mmap_;
   Darts::DoubleArray da_;
+  // trie node reached by the constant prefix (e.g. "U05:") of each
+  // rule and the number of ops that prefix covers.
+  std::vector<size_t> prefix_node_;
+  std::vector<size_t> prefix_size_;
+  // column referred by context-free unigram rules (%x[0,col] only), or -1.
+  std::vector<int>    unigram_col_;
   int getID(const char *str) const;
+  int getFeatureID(string_buffer *os,
+                   size_t i,
+                   size_t pos,
+                   const TaggerImpl &tagger) const;
+  int lookupRule(size_t i, size_t pos, const TaggerImpl &tagger) const;
+  void initRules();
 };
 }
 #endif
@@ -0,0 +1,1307 @@
+//
+//  CRF++ -- Yet Another CRF toolkit
+//
+//  $Id: lattice.cpp $;
+//
+//  Copyright(C) 2005-2007 Taku Kudo <taku@chasen.org>
+//
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "lattice.h"
+
+#ifdef CRFPP_USE_SIMD
+#include <immintrin.h>
+#endif
+
+namespace CRFPP {
+
+const double Lattice::kUnreachable = -1e37;
+
+namespace {
+
+// One step of the lattice recursions, producing a row of Y values:
+//   forward:  out[j] = log sum_k exp(trans[k*Y+j] + in[k]) + cost[j]
+//   backward: out[j] = log sum_k exp(trans[j*Y+k] + in[k]) + cost[j]
+//   viterbi:  out[j] = max_k in[k] + trans[k*Y+j] + cost[j],
+//             prev[j] = argmax (the first one on ties, -1 if none)
+//   exp:      out[j] = exp(in[j] - shift) for n values, in[j] <= shift
+//   add:      out[j] += in[j] for n values
+// and of the scaled recursion, before normalization:
+//   forward:  out[j] = cost[j] * sum_k in[k] * trans[k*Y+j]
+//   backward: out[j] = sum_k trans[j*Y+k] * cost[k] * in[k]
+//             (w is scratch of Y values)
+typedef void (*LogSumExpStep)(size_t Y, const double *trans,
+                              const double *in, const double *cost,
+                              double *out);
+typedef void (*MaxPlusStep)(size_t Y, const double *trans,
+                            const double *in, const double *cost,
+                            double *out, int *prev);
+typedef void (*ExpStep)(size_t n, const double *in, double shift,
+                        double *out);
+typedef void (*AddStep)(size_t n, const double *in, double *out);
+typedef void (*ScaledStep)(size_t Y, const double *trans, const double *in,
+                           const double *cost, double *out, double *w);
+
+struct Kernel {
+  LogSumExpStep  forward;
+  LogSumExpStep  backward;
+  MaxPlusStep    viterbi;
+  ExpStep        exp;
+  AddStep        add;
+  ScaledStep     scaled_forward;
+  ScaledStep     scaled_backward;
+};
+
+// The scalar steps are inline so that the fixed-size kernels below get
+// copies unrolled for their Y.
+inline void forwardScalar(size_t Y, const double *trans, const double *in,
+                   const double *cost, double *out) {
+  for (size_t j = 0; j < Y; ++j) {
+    double s = 0.0;
+    for (size_t k = 0; k < Y; ++k) {
+      s = logsumexp(s, trans[k * Y + j] + in[k], k == 0);
+    }
+    out[j] = s + cost[j];
+  }
+}
+
+inline void backwardScalar(size_t Y, const double *trans, const double *in,
+                    const double *cost, double *out) {
+  for (size_t j = 0; j < Y; ++j) {
+    double s = 0.0;
+    for (size_t k = 0; k < Y; ++k) {
+      s = logsumexp(s, trans[j * Y + k] + in[k], k == 0);
+    }
+    out[j] = s + cost[j];
+  }
+}
+
+inline void viterbiColumn(size_t Y, const double *trans, const double *in,
+                          const double *cost, double *out, int *prev,
+                          size_t j) {
+  double bestc = Lattice::kUnreachable;
+  int bestk = -1;
+  for (size_t k = 0; k < Y; ++k) {
+    const double c = in[k] + trans[k * Y + j] + cost[j];
+    if (c > bestc) {
+      bestc = c;
+      bestk = static_cast<int>(k);
+    }
+  }
+  prev[j] = bestk;
+  out[j] = bestk >= 0 ? bestc : Lattice::kUnreachable;
+}
+
+inline void viterbiScalar(size_t Y, const double *trans, const double *in,
+                   const double *cost, double *out, int *prev) {
+  for (size_t j = 0; j < Y; ++j) {
+    viterbiColumn(Y, trans, in, cost, out, prev, j);
+  }
+}
+
+void expScalar(size_t n, const double *in, double shift, double *out) {
+  for (size_t j = 0; j < n; ++j) {
+    out[j] = std::exp(in[j] - shift);
+  }
+}
+
+void addScalar(size_t n, const double *in, double *out) {
+  for (size_t j = 0; j < n; ++j) {
+    out[j] += in[j];
+  }
+}
+
+inline void scaledForwardScalar(size_t Y, const double *trans,
+                                const double *in, const double *cost,
+                                double *out, double *) {
+  for (size_t j = 0; j < Y; ++j) {
+    out[j] = 0.0;
+  }
+  for (size_t k = 0; k < Y; ++k) {
+    const double w = in[k];
+    const double *row = trans + k * Y;
+    for (size_t j = 0; j < Y; ++j) {
+      out[j] += w * row[j];
+    }
+  }
+  for (size_t j = 0; j < Y; ++j) {
+    out[j] *= cost[j];
+  }
+}
+
+inline void scaledBackwardScalar(size_t Y, const double *trans,
+                                 const double *in, const double *cost,
+                                 double *out, double *w) {
+  for (size_t k = 0; k < Y; ++k) {
+    w[k] = cost[k] * in[k];
+  }
+  for (size_t j = 0; j < Y; ++j) {
+    const double *row = trans + j * Y;
+    double sum = 0.0;
+    for (size_t k = 0; k < Y; ++k) {
+      sum += row[k] * w[k];
+    }
+    out[j] = sum;
+  }
+}
+
+// Kernels for a fixed, small number of tags: the same arithmetic in the
+// same order as the scalar ones, fully unrolled.
+const size_t kMaxFixedSize = 9;
+
+template <size_t Y>
+void forwardFixed(size_t, const double *trans, const double *in,
+                  const double *cost, double *out) {
+  forwardScalar(Y, trans, in, cost, out);
+}
+
+template <size_t Y>
+void backwardFixed(size_t, const double *trans, const double *in,
+                   const double *cost, double *out) {
+  backwardScalar(Y, trans, in, cost, out);
+}
+
+// written with selects rather than branches, which mispredict on
+// every other tag when Y is this small
+template <size_t Y>
+void viterbiFixed(size_t, const double *trans, const double *in,
+                  const double *cost, double *out, int *prev) {
+  for (size_t j = 0; j < Y; ++j) {
+    double bestc = Lattice::kUnreachable;
+    int bestk = -1;
+    for (size_t k = 0; k < Y; ++k) {
+      const double c = in[k] + trans[k * Y + j] + cost[j];
+      const bool better = c > bestc;
+      bestc = better ? c : bestc;
+      bestk = better ? static_cast<int>(k) : bestk;
+    }
+    prev[j] = bestk;
+    out[j] = bestk >= 0 ? bestc : Lattice::kUnreachable;
+  }
+}
+
+template <size_t Y>
+void scaledForwardFixed(size_t, const double *trans, const double *in,
+                        const double *cost, double *out, double *w) {
+  scaledForwardScalar(Y, trans, in, cost, out, w);
+}
+
+template <size_t Y>
+void scaledBackwardFixed(size_t, const double *trans, const double *in,
+                         const double *cost, double *out, double *w) {
+  scaledBackwardScalar(Y, trans, in, cost, out, w);
+}
+
+void scaledForwardGeneric(size_t Y, const double *trans, const double *in,
+                          const double *cost, double *out, double *w) {
+  scaledForwardScalar(Y, trans, in, cost, out, w);
+}
+
+void scaledBackwardGeneric(size_t Y, const double *trans, const double *in,
+                           const double *cost, double *out, double *w) {
+  scaledBackwardScalar(Y, trans, in, cost, out, w);
+}
+
+#ifdef CRFPP_USE_SIMD
+// The vector kernels take the maximum first and sum exp(x - max), which
+// differs from the pairwise logsumexp() only in rounding.
+// The max-plus kernels do the same additions and comparisons as
+// viterbiColumn(), so their results are identical to it.
+
+// max_k x_k + log sum_k exp(x_k - max), with x_k = trans[k*stride] + in[k]
+inline double logSumExpColumn(size_t Y, const double *trans, size_t stride,
+                              const double *in) {
+  double m = -std::numeric_limits<double>::infinity();
+  for (size_t k = 0; k < Y; ++k) {
+    m = std::max(m, trans[k * stride] + in[k]);
+  }
+  double s = 0.0;
+  for (size_t k = 0; k < Y; ++k) {
+    s += std::exp(trans[k * stride] + in[k] - m);
+  }
+  return m + std::log(s);
+}
+
+// exp(x) for x <= 0: Cody-Waite reduction to |r| <= log(2)/2 and a
+// degree 12 Taylor polynomial, accurate to a few ulp.
+#define EXP_POLY(FMA, SET1, r)                      \
+  FMA(FMA(FMA(FMA(FMA(FMA(FMA(FMA(FMA(FMA(FMA(FMA(  \
+  SET1(1.0 / 479001600.0), r, SET1(1.0 / 39916800.0)), \
+  r, SET1(1.0 / 3628800.0)), r, SET1(1.0 / 362880.0)), \
+  r, SET1(1.0 / 40320.0)), r, SET1(1.0 / 5040.0)),     \
+  r, SET1(1.0 / 720.0)), r, SET1(1.0 / 120.0)),        \
+  r, SET1(1.0 / 24.0)), r, SET1(1.0 / 6.0)),           \
+  r, SET1(0.5)), r, SET1(1.0)), r, SET1(1.0))
+
+CRFPP_TARGET_AVX2
+inline __m256d exp4(__m256d x) {
+  x = _mm256_max_pd(x, _mm256_set1_pd(-708.0));
+  const __m256d n = _mm256_round_pd(
+      _mm256_mul_pd(x, _mm256_set1_pd(1.4426950408889634)),
+      _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m256d r = _mm256_fnmadd_pd(n, _mm256_set1_pd(6.93145751953125e-1), x);
+  r = _mm256_fnmadd_pd(n, _mm256_set1_pd(1.42860682030941723212e-6), r);
+  const __m256d p = EXP_POLY(_mm256_fmadd_pd, _mm256_set1_pd, r);
+  const __m256i e = _mm256_slli_epi64(
+      _mm256_add_epi64(_mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(n)),
+                       _mm256_set1_epi64x(1023)), 52);
+  return _mm256_mul_pd(p, _mm256_castsi256_pd(e));
+}
+
+CRFPP_TARGET_AVX2
+inline double hmax4(__m256d v) {
+  __m128d h = _mm_max_pd(_mm256_castpd256_pd128(v),
+                         _mm256_extractf128_pd(v, 1));
+  return _mm_cvtsd_f64(_mm_max_sd(h, _mm_unpackhi_pd(h, h)));
+}
+
+CRFPP_TARGET_AVX2
+inline double hsum4(__m256d v) {
+  __m128d h = _mm_add_pd(_mm256_castpd256_pd128(v),
+                         _mm256_extractf128_pd(v, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(h, _mm_unpackhi_pd(h, h)));
+}
+
+CRFPP_TARGET_AVX2
+void forwardAVX2(size_t Y, const double *trans, const double *in,
+                 const double *cost, double *out) {
+  size_t j = 0;
+  for (; j + 4 <= Y; j += 4) {
+    __m256d m = _mm256_add_pd(_mm256_loadu_pd(trans + j),
+                              _mm256_set1_pd(in[0]));
+    for (size_t k = 1; k < Y; ++k) {
+      m = _mm256_max_pd(m, _mm256_add_pd(_mm256_loadu_pd(trans + k * Y + j),
+                                         _mm256_set1_pd(in[k])));
+    }
+    __m256d s = _mm256_setzero_pd();
+    for (size_t k = 0; k < Y; ++k) {
+      const __m256d x = _mm256_add_pd(_mm256_loadu_pd(trans + k * Y + j),
+                                      _mm256_set1_pd(in[k]));
+      s = _mm256_add_pd(s, exp4(_mm256_sub_pd(x, m)));
+    }
+    double ms[4], ss[4];
+    _mm256_storeu_pd(ms, m);
+    _mm256_storeu_pd(ss, s);
+    for (size_t l = 0; l < 4; ++l) {
+      out[j + l] = ms[l] + std::log(ss[l]) + cost[j + l];
+    }
+  }
+  for (; j < Y; ++j) {
+    out[j] = logSumExpColumn(Y, trans + j, Y, in) + cost[j];
+  }
+}
+
+CRFPP_TARGET_AVX2
+void backwardAVX2(size_t Y, const double *trans, const double *in,
+                  const double *cost, double *out) {
+  const size_t n = Y & ~static_cast<size_t>(3);
+  for (size_t j = 0; j < Y; ++j) {
+    const double *row = trans + j * Y;
+    __m256d mv = _mm256_set1_pd(-std::numeric_limits<double>::infinity());
+    for (size_t k = 0; k < n; k += 4) {
+      mv = _mm256_max_pd(mv, _mm256_add_pd(_mm256_loadu_pd(row + k),
+                                           _mm256_loadu_pd(in + k)));
+    }
+    double m = hmax4(mv);
+    for (size_t k = n; k < Y; ++k) {
+      m = std::max(m, row[k] + in[k]);
+    }
+    const __m256d mm = _mm256_set1_pd(m);
+    __m256d sv = _mm256_setzero_pd();
+    for (size_t k = 0; k < n; k += 4) {
+      const __m256d x = _mm256_add_pd(_mm256_loadu_pd(row + k),
+                                      _mm256_loadu_pd(in + k));
+      sv = _mm256_add_pd(sv, exp4(_mm256_sub_pd(x, mm)));
+    }
+    double s = hsum4(sv);
+    for (size_t k = n; k < Y; ++k) {
+      s += std::exp(row[k] + in[k] - m);
+    }
+    out[j] = m + std::log(s) + cost[j];
+  }
+}
+
+CRFPP_TARGET_AVX2
+void expAVX2(size_t n, const double *in, double shift, double *out) {
+  const __m256d sv = _mm256_set1_pd(shift);
+  size_t j = 0;
+  for (; j + 4 <= n; j += 4) {
+    _mm256_storeu_pd(out + j,
+                     exp4(_mm256_sub_pd(_mm256_loadu_pd(in + j), sv)));
+  }
+  for (; j < n; ++j) {
+    out[j] = std::exp(in[j] - shift);
+  }
+}
+
+CRFPP_TARGET_AVX2
+void addAVX2(size_t n, const double *in, double *out) {
+  size_t j = 0;
+  for (; j + 8 <= n; j += 8) {
+    const __m256d a = _mm256_add_pd(_mm256_loadu_pd(out + j),
+                                    _mm256_loadu_pd(in + j));
+    const __m256d b = _mm256_add_pd(_mm256_loadu_pd(out + j + 4),
+                                    _mm256_loadu_pd(in + j + 4));
+    _mm256_storeu_pd(out + j, a);
+    _mm256_storeu_pd(out + j + 4, b);
+  }
+  for (; j + 4 <= n; j += 4) {
+    _mm256_storeu_pd(out + j, _mm256_add_pd(_mm256_loadu_pd(out + j),
+                                            _mm256_loadu_pd(in + j)));
+  }
+  for (; j < n; ++j) {
+    out[j] += in[j];
+  }
+}
+
+CRFPP_TARGET_AVX2
+void viterbiAVX2(size_t Y, const double *trans, const double *in,
+                 const double *cost, double *out, int *prev) {
+  size_t j = 0;
+  for (; j + 4 <= Y; j += 4) {
+    const __m256d c0 = _mm256_loadu_pd(cost + j);
+    __m256d bestc = _mm256_set1_pd(Lattice::kUnreachable);
+    __m256d bestk = _mm256_set1_pd(-1.0);
+    for (size_t k = 0; k < Y; ++k) {
+      const __m256d c = _mm256_add_pd(
+          _mm256_add_pd(_mm256_set1_pd(in[k]),
+                        _mm256_loadu_pd(trans + k * Y + j)), c0);
+      const __m256d gt = _mm256_cmp_pd(c, bestc, _CMP_GT_OQ);
+      bestc = _mm256_blendv_pd(bestc, c, gt);
+      bestk = _mm256_blendv_pd(bestk, _mm256_set1_pd(static_cast<double>(k)),
+                               gt);
+    }
+    double bc[4], bk[4];
+    _mm256_storeu_pd(bc, bestc);
+    _mm256_storeu_pd(bk, bestk);
+    for (size_t l = 0; l < 4; ++l) {
+      prev[j + l] = static_cast<int>(bk[l]);
+      out[j + l] = prev[j + l] >= 0 ? bc[l] : Lattice::kUnreachable;
+    }
+  }
+  for (; j < Y; ++j) {
+    viterbiColumn(Y, trans, in, cost, out, prev, j);
+  }
+}
+
+// GCC warns on _mm512_undefined_pd() in the intrinsic headers.
+#if !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+CRFPP_TARGET_AVX512
+inline __m512d exp8(__m512d x) {
+  x = _mm512_max_pd(x, _mm512_set1_pd(-708.0));
+  const __m512d n = _mm512_roundscale_pd(
+      _mm512_mul_pd(x, _mm512_set1_pd(1.4426950408889634)),
+      _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m512d r = _mm512_fnmadd_pd(n, _mm512_set1_pd(6.93145751953125e-1), x);
+  r = _mm512_fnmadd_pd(n, _mm512_set1_pd(1.42860682030941723212e-6), r);
+  return _mm512_scalef_pd(EXP_POLY(_mm512_fmadd_pd, _mm512_set1_pd, r), n);
+}
+
+CRFPP_TARGET_AVX512
+void forwardAVX512(size_t Y, const double *trans, const double *in,
+                   const double *cost, double *out) {
+  for (size_t j = 0; j < Y; j += 8) {
+    const __mmask8 mask = Y - j >= 8 ? 0xff : (1 << (Y - j)) - 1;
+    __m512d m = _mm512_add_pd(_mm512_maskz_loadu_pd(mask, trans + j),
+                              _mm512_set1_pd(in[0]));
+    for (size_t k = 1; k < Y; ++k) {
+      m = _mm512_max_pd(m, _mm512_add_pd(
+          _mm512_maskz_loadu_pd(mask, trans + k * Y + j),
+          _mm512_set1_pd(in[k])));
+    }
+    __m512d s = _mm512_setzero_pd();
+    for (size_t k = 0; k < Y; ++k) {
+      const __m512d x = _mm512_add_pd(
+          _mm512_maskz_loadu_pd(mask, trans + k * Y + j),
+          _mm512_set1_pd(in[k]));
+      s = _mm512_add_pd(s, exp8(_mm512_sub_pd(x, m)));
+    }
+    double ms[8], ss[8];
+    _mm512_storeu_pd(ms, m);
+    _mm512_storeu_pd(ss, s);
+    for (size_t l = 0; l < 8 && j + l < Y; ++l) {
+      out[j + l] = ms[l] + std::log(ss[l]) + cost[j + l];
+    }
+  }
+}
+
+CRFPP_TARGET_AVX512
+void backwardAVX512(size_t Y, const double *trans, const double *in,
+                    const double *cost, double *out) {
+  const __m512d ninf =
+      _mm512_set1_pd(-std::numeric_limits<double>::infinity());
+  for (size_t j = 0; j < Y; ++j) {
+    const double *row = trans + j * Y;
+    __m512d mv = ninf;
+    for (size_t k = 0; k < Y; k += 8) {
+      const __mmask8 mask = Y - k >= 8 ? 0xff : (1 << (Y - k)) - 1;
+      const __m512d x = _mm512_add_pd(_mm512_maskz_loadu_pd(mask, row + k),
+                                      _mm512_maskz_loadu_pd(mask, in + k));
+      mv = _mm512_mask_max_pd(mv, mask, mv, x);
+    }
+    double v[8];
+    _mm512_storeu_pd(v, mv);
+    double m = v[0];
+    for (size_t l = 1; l < 8; ++l) {
+      m = std::max(m, v[l]);
+    }
+    const __m512d mm = _mm512_set1_pd(m);
+    __m512d sv = _mm512_setzero_pd();
+    for (size_t k = 0; k < Y; k += 8) {
+      const __mmask8 mask = Y - k >= 8 ? 0xff : (1 << (Y - k)) - 1;
+      const __m512d x = _mm512_add_pd(_mm512_maskz_loadu_pd(mask, row + k),
+                                      _mm512_maskz_loadu_pd(mask, in + k));
+      sv = _mm512_mask_add_pd(sv, mask, sv, exp8(_mm512_sub_pd(x, mm)));
+    }
+    _mm512_storeu_pd(v, sv);
+    const double s = ((v[0] + v[1]) + (v[2] + v[3])) +
+        ((v[4] + v[5]) + (v[6] + v[7]));
+    out[j] = m + std::log(s) + cost[j];
+  }
+}
+
+CRFPP_TARGET_AVX512
+void expAVX512(size_t n, const double *in, double shift, double *out) {
+  const __m512d sv = _mm512_set1_pd(shift);
+  for (size_t j = 0; j < n; j += 8) {
+    const __mmask8 mask = n - j >= 8 ? 0xff : (1 << (n - j)) - 1;
+    _mm512_mask_storeu_pd(out + j, mask, exp8(_mm512_sub_pd(
+        _mm512_maskz_loadu_pd(mask, in + j), sv)));
+  }
+}
+
+CRFPP_TARGET_AVX512
+void addAVX512(size_t n, const double *in, double *out) {
+  for (size_t j = 0; j < n; j += 8) {
+    const __mmask8 mask = n - j >= 8 ? 0xff : (1 << (n - j)) - 1;
+    _mm512_mask_storeu_pd(out + j, mask, _mm512_add_pd(
+        _mm512_maskz_loadu_pd(mask, out + j),
+        _mm512_maskz_loadu_pd(mask, in + j)));
+  }
+}
+
+CRFPP_TARGET_AVX512
+void viterbiAVX512(size_t Y, const double *trans, const double *in,
+                   const double *cost, double *out, int *prev) {
+  for (size_t j = 0; j < Y; j += 8) {
+    const __mmask8 mask = Y - j >= 8 ? 0xff : (1 << (Y - j)) - 1;
+    const __m512d c0 = _mm512_maskz_loadu_pd(mask, cost + j);
+    __m512d bestc = _mm512_set1_pd(Lattice::kUnreachable);
+    __m512d bestk = _mm512_set1_pd(-1.0);
+    for (size_t k = 0; k < Y; ++k) {
+      const __m512d c = _mm512_add_pd(
+          _mm512_add_pd(_mm512_set1_pd(in[k]),
+                        _mm512_maskz_loadu_pd(mask, trans + k * Y + j)), c0);
+      const __mmask8 gt = _mm512_cmp_pd_mask(c, bestc, _CMP_GT_OQ);
+      bestc = _mm512_mask_blend_pd(gt, bestc, c);
+      bestk = _mm512_mask_blend_pd(gt, bestk,
+                                   _mm512_set1_pd(static_cast<double>(k)));
+    }
+    double bc[8], bk[8];
+    _mm512_storeu_pd(bc, bestc);
+    _mm512_storeu_pd(bk, bestk);
+    for (size_t l = 0; l < 8 && j + l < Y; ++l) {
+      prev[j + l] = static_cast<int>(bk[l]);
+      out[j + l] = prev[j + l] >= 0 ? bc[l] : Lattice::kUnreachable;
+    }
+  }
+}
+
+#if !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#undef EXP_POLY
+#endif  // CRFPP_USE_SIMD
+
+Kernel selectKernel() {
+  Kernel kernel = { &forwardScalar, &backwardScalar,
+                    &viterbiScalar, &expScalar, &addScalar,
+                    &scaledForwardGeneric, &scaledBackwardGeneric };
+#ifdef CRFPP_USE_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    kernel.forward  = &forwardAVX512;
+    kernel.backward = &backwardAVX512;
+    kernel.viterbi  = &viterbiAVX512;
+    kernel.exp      = &expAVX512;
+    kernel.add      = &addAVX512;
+  } else if (__builtin_cpu_supports("avx2") &&
+             __builtin_cpu_supports("fma")) {
+    kernel.forward  = &forwardAVX2;
+    kernel.backward = &backwardAVX2;
+    kernel.viterbi  = &viterbiAVX2;
+    kernel.exp      = &expAVX2;
+    kernel.add      = &addAVX2;
+  }
+#endif
+  return kernel;
+}
+
+// chosen once when the library is loaded
+const Kernel kKernel = selectKernel();
+
+// The vector kernels work on 4 or 8 tags at once and win from Y = 4 on,
+// so the unrolled log-space and viterbi steps replace them only below.
+template <size_t Y>
+Kernel fixedKernel() {
+  Kernel kernel = kKernel;
+  if (Y < 4 || kKernel.viterbi == &viterbiScalar) {
+    kernel.forward  = &forwardFixed<Y>;
+    kernel.backward = &backwardFixed<Y>;
+    kernel.viterbi  = &viterbiFixed<Y>;
+  }
+  kernel.scaled_forward  = &scaledForwardFixed<Y>;
+  kernel.scaled_backward = &scaledBackwardFixed<Y>;
+  return kernel;
+}
+
+const Kernel kFixedKernel[kMaxFixedSize + 1] = {
+  kKernel, kKernel, fixedKernel<2>(), fixedKernel<3>(), fixedKernel<4>(),
+  fixedKernel<5>(), fixedKernel<6>(), fixedKernel<7>(), fixedKernel<8>(),
+  fixedKernel<9>()
+};
+
+const Kernel *kernelFor(size_t ysize) {
+  return ysize <= kMaxFixedSize ? &kFixedKernel[ysize] : &kKernel;
+}
+
+// max and min of x[0..n-1]
+void minmax(const double *x, size_t n, double *vmin, double *vmax) {
+  *vmin = *vmax = x[0];
+  for (size_t i = 1; i < n; ++i) {
+    *vmin = std::min(*vmin, x[i]);
+    *vmax = std::max(*vmax, x[i]);
+  }
+}
+
+// normalize x[0..n-1] to sum 1 and return the log of the sum.
+double normalize(double *x, size_t n) {
+  double sum = 0.0;
+  for (size_t i = 0; i < n; ++i) {
+    sum += x[i];
+  }
+  const double inv = 1.0 / sum;
+  for (size_t i = 0; i < n; ++i) {
+    x[i] *= inv;
+  }
+  return std::log(sum);
+}
+
+// steps of the lattice recursions over the transitions of |table|;
+// see the dense kernels above for the formulas.
+void viterbiSparse(const TransitionTable &table, size_t Y,
+                   const double *trans, const double *in,
+                   const double *cost, double *out, int *prev) {
+  for (size_t j = 0; j < Y; ++j) {
+    const unsigned short int *pred = table.pred(j);
+    const size_t n = table.pred_size(j);
+    double bestc = Lattice::kUnreachable;
+    int bestk = -1;
+    for (size_t p = 0; p < n; ++p) {
+      const size_t k = pred[p];
+      const double c = in[k] + trans[k * Y + j] + cost[j];
+      if (c > bestc) {
+        bestc = c;
+        bestk = static_cast<int>(k);
+      }
+    }
+    prev[j] = bestk;
+    out[j] = bestc;
+  }
+}
+
+void forwardSparse(const TransitionTable &table, size_t Y,
+                   const double *trans, const double *in,
+                   const double *cost, double *out) {
+  for (size_t j = 0; j < Y; ++j) {
+    const unsigned short int *pred = table.pred(j);
+    const size_t n = table.pred_size(j);
+    double s = Lattice::kUnreachable;
+    for (size_t p = 0; p < n; ++p) {
+      const size_t k = pred[p];
+      s = logsumexp(s, trans[k * Y + j] + in[k], p == 0);
+    }
+    out[j] = s + cost[j];
+  }
+}
+
+void backwardSparse(const TransitionTable &table, size_t Y,
+                    const double *trans, const double *in,
+                    const double *cost, double *out) {
+  for (size_t j = 0; j < Y; ++j) {
+    const unsigned short int *succ = table.succ(j);
+    const size_t n = table.succ_size(j);
+    double s = Lattice::kUnreachable;
+    for (size_t p = 0; p < n; ++p) {
+      const size_t k = succ[p];
+      s = logsumexp(s, trans[j * Y + k] + in[k], p == 0);
+    }
+    out[j] = s + cost[j];
+  }
+}
+
+void scaledForwardSparse(const TransitionTable &table, size_t Y,
+                         const double *trans, const double *in,
+                         const double *cost, double *out) {
+  for (size_t j = 0; j < Y; ++j) {
+    const unsigned short int *pred = table.pred(j);
+    const size_t n = table.pred_size(j);
+    double s = 0.0;
+    for (size_t p = 0; p < n; ++p) {
+      s += in[pred[p]] * trans[pred[p] * Y + j];
+    }
+    out[j] = s * cost[j];
+  }
+}
+
+void scaledBackwardSparse(const TransitionTable &table, size_t Y,
+                          const double *trans, const double *in,
+                          const double *cost, double *out, double *w) {
+  for (size_t k = 0; k < Y; ++k) {
+    w[k] = cost[k] * in[k];
+  }
+  for (size_t j = 0; j < Y; ++j) {
+    const unsigned short int *succ = table.succ(j);
+    const size_t n = table.succ_size(j);
+    const double *row = trans + j * Y;
+    double s = 0.0;
+    for (size_t p = 0; p < n; ++p) {
+      s += row[succ[p]] * w[succ[p]];
+    }
+    out[j] = s;
+  }
+}
+
+// max and min of the allowed entries of the Y x Y matrix |x|
+void minmaxSparse(const TransitionTable &table, const double *x,
+                  double *vmin, double *vmax) {
+  const size_t Y = table.ysize();
+  *vmin = 0.0;
+  *vmax = 0.0;
+  bool first = true;
+  for (size_t k = 0; k < Y; ++k) {
+    const unsigned short int *succ = table.succ(k);
+    for (size_t p = 0; p < table.succ_size(k); ++p) {
+      const double v = x[k * Y + succ[p]];
+      *vmin = first ? v : std::min(*vmin, v);
+      *vmax = first ? v : std::max(*vmax, v);
+      first = false;
+    }
+  }
+}
+
+// orders tags by descending score
+class BeamComp {
+ public:
+  explicit BeamComp(const double *score) : score_(score) {}
+  bool operator()(unsigned short int a, unsigned short int b) const {
+    return score_[a] > score_[b];
+  }
+ private:
+  const double *score_;
+};
+}  // namespace
+
+void addLongVector(size_t n, const double *x, double *y) {
+  kKernel.add(n, x, y);
+}
+
+void TransitionTable::set(size_t ysize, const std::vector<char> &allowed) {
+  ysize_ = ysize;
+  allowed_ = allowed;
+  pred_begin_.assign(ysize + 1, 0);
+  succ_begin_.assign(ysize + 1, 0);
+  pred_.clear();
+  succ_.clear();
+  for (size_t j = 0; j < ysize; ++j) {
+    for (size_t k = 0; k < ysize; ++k) {
+      if (allowed_[k * ysize + j]) {
+        pred_.push_back(static_cast<unsigned short int>(k));
+      }
+    }
+    pred_begin_[j + 1] = pred_.size();
+  }
+  for (size_t k = 0; k < ysize; ++k) {
+    for (size_t j = 0; j < ysize; ++j) {
+      if (allowed_[k * ysize + j]) {
+        succ_.push_back(static_cast<unsigned short int>(j));
+      }
+    }
+    succ_begin_[k + 1] = succ_.size();
+  }
+}
+
+// keeps alpha, beta and their products well above DBL_MIN
+const double Lattice::kMaxRange = 300.0;
+
+void Lattice::resize(size_t size, size_t ysize, bool shared_transition) {
+  size_  = size;
+  ysize_ = ysize;
+  shared_transition_ = shared_transition;
+  emission_.resize(size * ysize);
+  transition_.resize((shared_transition ? 1 : size) * ysize * ysize);
+  alpha_.resize(size * ysize);
+  beta_.resize(size * ysize);
+  best_.resize(size * ysize);
+  prev_.resize(size * ysize);
+  table_ = 0;
+  has_alpha_ = has_beta_ = false;
+  alpha_pending_ = beta_pending_ = false;
+  allowed_.assign(size, static_cast<const unsigned short int *>(0));
+  allowed_size_.assign(size, ysize);
+}
+
+void Lattice::set_allowed(size_t i, const unsigned short int *tags,
+                          size_t n) {
+  allowed_[i] = tags;
+  allowed_size_[i] = n;
+}
+
+double Lattice::forwardbackward() {
+  if (size_ == 0) {
+    return 0.0;
+  }
+
+  scaled_ = expScaled();
+  if (scaled_) {
+    forwardScaled();
+    backwardScaled();
+  } else {
+    forwardLog();
+    backwardLog();
+  }
+  has_alpha_ = has_beta_ = true;
+  alpha_pending_ = beta_pending_ = scaled_;
+  return Z_;
+}
+
+double Lattice::forward() {
+  if (size_ == 0) {
+    return 0.0;
+  }
+
+  scaled_ = expScaled();
+  if (scaled_) {
+    forwardScaled();
+  } else {
+    forwardLog();
+    const double *a = &alpha_[(size_ - 1) * ysize_];
+    Z_ = 0.0;
+    for (size_t j = 0; j < ysize_; ++j) {
+      Z_ = logsumexp(Z_, a[j], j == 0);
+    }
+  }
+  has_alpha_ = true;
+  has_beta_ = false;
+  alpha_pending_ = scaled_;
+  beta_pending_ = false;
+  return Z_;
+}
+
+void Lattice::backward() {
+  if (size_ == 0 || !has_alpha_ || has_beta_) {
+    return;
+  }
+
+  if (scaled_) {
+    backwardScaled();
+  } else {
+    backwardLog();
+  }
+  has_beta_ = true;
+  beta_pending_ = scaled_;
+}
+
+// Take exp(cost - max) of the emissions and transitions of every
+// position, or return false if the scaled recursion may underflow.
+bool Lattice::expScaled() {
+  const Kernel *kernel = kernelFor(ysize_);
+  const size_t Y = ysize_;
+  const size_t YY = Y * Y;
+  pemission_.resize(size_ * Y);
+  ptransition_.resize((shared_transition_ ? 1 : size_) * YY);
+  emission_max_.resize(size_);
+  transition_max_.resize(size_);
+  palpha_.resize(size_ * Y);
+  pbeta_.resize(size_ * Y);
+  alpha_scale_.resize(size_);
+  beta_scale_.resize(size_);
+  weight_.resize(Y);
+  node_marginal_.resize(Y);
+  edge_marginal_.resize(YY);
+
+  // Every alpha and beta entry is at least exp(-range) / Y of the sum
+  // of its row, where range is that of the emission and transition
+  // costs of one position.
+  double vmin = 0.0;
+  double tmin = 0.0;
+  double tmax = 0.0;
+  for (size_t i = 0; i < size_; ++i) {
+    minmax(emission(i), Y, &vmin, &emission_max_[i]);
+    double range = emission_max_[i] - vmin;
+    transition_max_[i] = 0.0;
+    const bool exp_transition = i == 1 || (i > 1 && !shared_transition_);
+    if (exp_transition) {
+      if (table_) {
+        minmaxSparse(*table_, transition(i), &tmin, &tmax);
+      } else {
+        minmax(transition(i), YY, &tmin, &tmax);
+      }
+    }
+    transition_max_[i] = i > 0 ? tmax : 0.0;
+    if (i > 0) {
+      range += tmax - tmin;
+    }
+    if (!(range < kMaxRange)) {
+      return false;  // too wide or not finite
+    }
+    kernel->exp(Y, emission(i), emission_max_[i], &pemission_[i * Y]);
+    if (exp_transition && table_) {
+      // disallowed transitions get probability 0
+      const double *t = transition(i);
+      double *p = &ptransition_[shared_transition_ ? 0 : i * YY];
+      std::fill(p, p + YY, 0.0);
+      for (size_t k = 0; k < Y; ++k) {
+        const unsigned short int *succ = table_->succ(k);
+        for (size_t s = 0; s < table_->succ_size(k); ++s) {
+          p[k * Y + succ[s]] = std::exp(t[k * Y + succ[s]] - tmax);
+        }
+      }
+    } else if (exp_transition) {
+      kernel->exp(YY, transition(i), tmax,
+                  &ptransition_[shared_transition_ ? 0 : i * YY]);
+    }
+  }
+
+  return true;
+}
+
+// alpha(i)[j] = log(palpha[i][j]) + alpha_scale[i]
+void Lattice::forwardScaled() {
+  const Kernel *kernel = kernelFor(ysize_);
+  const size_t Y = ysize_;
+  double *a = &palpha_[0];
+  for (size_t j = 0; j < Y; ++j) {
+    a[j] = pemission_[j];
+  }
+  alpha_scale_[0] = emission_max_[0] + normalize(a, Y);
+  for (size_t i = 1; i < size_; ++i) {
+    const double *la = &palpha_[(i - 1) * Y];
+    const double *trans = ptransition(i);
+    const double *e = &pemission_[i * Y];
+    a = &palpha_[i * Y];
+    if (table_) {
+      scaledForwardSparse(*table_, Y, trans, la, e, a);
+    } else {
+      kernel->scaled_forward(Y, trans, la, e, a, 0);
+    }
+    alpha_scale_[i] = alpha_scale_[i - 1] + emission_max_[i] +
+        transition_max_[i] + normalize(a, Y);
+  }
+
+  // the last alpha row sums to 1
+  Z_ = alpha_scale_[size_ - 1];
+}
+
+// beta(i)[j] = log(pbeta[i][j]) + beta_scale[i] + emission(i)[j]
+void Lattice::backwardScaled() {
+  const Kernel *kernel = kernelFor(ysize_);
+  const size_t Y = ysize_;
+  const size_t last = size_ - 1;
+  double *b = &pbeta_[last * Y];
+  for (size_t j = 0; j < Y; ++j) {
+    b[j] = 1.0;
+  }
+  beta_scale_[last] = normalize(b, Y);
+  double *w = &weight_[0];
+  for (size_t i = last; i-- > 0;) {
+    const double *rb = &pbeta_[(i + 1) * Y];
+    const double *trans = ptransition(i + 1);
+    const double *e = &pemission_[(i + 1) * Y];
+    b = &pbeta_[i * Y];
+    if (table_) {
+      scaledBackwardSparse(*table_, Y, trans, rb, e, b, w);
+    } else {
+      kernel->scaled_backward(Y, trans, rb, e, b, w);
+    }
+    beta_scale_[i] = beta_scale_[i + 1] + emission_max_[i + 1] +
+        transition_max_[i + 1] + normalize(b, Y);
+  }
+}
+
+// log tables of the scaled recursion, filled when first read
+void Lattice::fillAlpha() const {
+  const size_t Y = ysize_;
+  for (size_t i = 0; i < size_; ++i) {
+    const double *pa = &palpha_[i * Y];
+    for (size_t j = 0; j < Y; ++j) {
+      alpha_[i * Y + j] = std::log(pa[j]) + alpha_scale_[i];
+    }
+  }
+  alpha_pending_ = false;
+}
+
+void Lattice::fillBeta() const {
+  const size_t Y = ysize_;
+  for (size_t i = 0; i < size_; ++i) {
+    const double *pb = &pbeta_[i * Y];
+    const double *cost = emission(i);
+    for (size_t j = 0; j < Y; ++j) {
+      beta_[i * Y + j] = std::log(pb[j]) + beta_scale_[i] + cost[j];
+    }
+  }
+  beta_pending_ = false;
+}
+
+void Lattice::forwardLog() {
+  const Kernel *kernel = kernelFor(ysize_);
+  const size_t Y = ysize_;
+  node_marginal_.resize(Y);
+  edge_marginal_.resize(Y * Y);
+
+  for (size_t j = 0; j < Y; ++j) {
+    alpha_[j] = emission_[j];
+  }
+  for (size_t i = 1; i < size_; ++i) {
+    if (table_) {
+      forwardSparse(*table_, Y, transition(i), &alpha_[(i - 1) * Y],
+                    emission(i), &alpha_[i * Y]);
+    } else {
+      kernel->forward(Y, transition(i), &alpha_[(i - 1) * Y],
+                      emission(i), &alpha_[i * Y]);
+    }
+  }
+}
+
+void Lattice::backwardLog() {
+  const Kernel *kernel = kernelFor(ysize_);
+  const size_t Y = ysize_;
+  const size_t last = size_ - 1;
+  for (size_t j = 0; j < Y; ++j) {
+    beta_[last * Y + j] = emission_[last * Y + j];
+  }
+  for (size_t i = last; i-- > 0;) {
+    if (table_) {
+      backwardSparse(*table_, Y, transition(i + 1), &beta_[(i + 1) * Y],
+                     emission(i), &beta_[i * Y]);
+    } else {
+      kernel->backward(Y, transition(i + 1), &beta_[(i + 1) * Y],
+                       emission(i), &beta_[i * Y]);
+    }
+  }
+
+  Z_ = 0.0;
+  for (size_t j = 0; j < Y; ++j) {
+    Z_ = logsumexp(Z_, beta_[j], j == 0);
+  }
+}
+
+const double *Lattice::node_marginal(size_t i) {
+  const size_t Y = ysize_;
+  double *p = &node_marginal_[0];
+  if (scaled_) {
+    const double *pa = &palpha_[i * Y];
+    const double *pb = &pbeta_[i * Y];
+    const double r = std::exp(alpha_scale_[i] + beta_scale_[i] - Z_);
+    for (size_t j = 0; j < Y; ++j) {
+      p[j] = pa[j] * pb[j] * r;
+    }
+  } else {
+    const double *a = alpha(i);
+    const double *b = beta(i);
+    const double *cost = emission(i);
+    for (size_t j = 0; j < Y; ++j) {
+      p[j] = std::exp(a[j] + b[j] - cost[j] - Z_);
+    }
+  }
+  return p;
+}
+
+double Lattice::marginal(size_t i, size_t j) const {
+  const size_t Y = ysize_;
+  if (scaled_) {
+    return palpha_[i * Y + j] * pbeta_[i * Y + j] *
+        std::exp(alpha_scale_[i] + beta_scale_[i] - Z_);
+  }
+  return std::exp(alpha_[i * Y + j] + beta_[i * Y + j] -
+                  emission_[i * Y + j] - Z_);
+}
+
+const double *Lattice::edge_marginal(size_t i) {
+  const size_t Y = ysize_;
+  double *p = &edge_marginal_[0];
+  if (scaled_) {
+    // p(k, j) = palpha[i-1][k] * ptrans[k][j] * pemission[j] * pbeta[j],
+    // rescaled
+    const double *la = &palpha_[(i - 1) * Y];
+    const double *trans = ptransition(i);
+    const double *e = &pemission_[i * Y];
+    const double *pb = &pbeta_[i * Y];
+    const double r = std::exp(alpha_scale_[i - 1] + transition_max_[i] +
+                              emission_max_[i] + beta_scale_[i] - Z_);
+    double *w = &weight_[0];
+    for (size_t j = 0; j < Y; ++j) {
+      w[j] = e[j] * pb[j] * r;
+    }
+    for (size_t k = 0; k < Y; ++k) {
+      const double *row = trans + k * Y;
+      for (size_t j = 0; j < Y; ++j) {
+        p[k * Y + j] = la[k] * row[j] * w[j];
+      }
+    }
+  } else {
+    const double *la = alpha(i - 1);
+    const double *trans = transition(i);
+    const double *b = beta(i);
+    for (size_t k = 0; k < Y; ++k) {
+      for (size_t j = 0; j < Y; ++j) {
+        p[k * Y + j] = table_ && !table_->allowed(k, j) ? 0.0 :
+            std::exp(la[k] + trans[k * Y + j] + b[j] - Z_);
+      }
+    }
+  }
+  return p;
+}
+
+double Lattice::viterbi(unsigned short int *result) {
+  if (size_ == 0) {
+    return 0.0;
+  }
+
+  startViterbi();
+  for (size_t i = 1; i < size_; ++i) {
+    stepViterbi(i, transition(i));
+  }
+  return finishViterbi(result);
+}
+
+void Lattice::startViterbi() {
+  for (size_t j = 0; j < ysize_; ++j) {
+    best_[j] = emission_[j];
+    prev_[j] = -1;
+  }
+}
+
+void Lattice::stepViterbi(size_t i, const double *transition) {
+  const size_t Y = ysize_;
+  if (table_) {
+    viterbiSparse(*table_, Y, transition, &best_[(i - 1) * Y], emission(i),
+                  &best_[i * Y], &prev_[i * Y]);
+    return;
+  }
+  kernelFor(Y)->viterbi(Y, transition, &best_[(i - 1) * Y], emission(i),
+                        &best_[i * Y], &prev_[i * Y]);
+}
+
+namespace {
+// added to the cost of a disallowed transition
+const double kDisallowed[2] = { Lattice::kUnreachable, 0.0 };
+// cost of a transition in stepAllowed() relative to one in the vector
+// kernels
+const size_t kSparseStepCost = 4;
+}  // namespace
+
+void Lattice::startBeam(size_t width, double threshold) {
+  beam_width_ = width;
+  beam_threshold_ = threshold;
+  startViterbi();
+  if (allowed_[0]) {
+    for (size_t j = 0; j < ysize_; ++j) {
+      best_[j] = kUnreachable;
+    }
+    for (size_t t = 0; t < allowed_size_[0]; ++t) {
+      best_[allowed_[0][t]] = emission_[allowed_[0][t]];
+    }
+  }
+  pruneBeam(0);
+}
+
+void Lattice::stepBeam(size_t i, const double *transition) {
+  const size_t Y = ysize_;
+  if (beam_.size() == Y && !allowed_[i]) {
+    stepViterbi(i, transition);
+    pruneBeam(i);
+    return;
+  }
+  const double *in = &best_[(i - 1) * Y];
+  const double *cost = emission(i);
+  double *out = &best_[i * Y];
+  int *prev = &prev_[i * Y];
+  const unsigned short int *tags = allowed_[i];
+  if (tags) {
+    // The vector kernel over every transition beats the scalar loop
+    // over the allowed ones unless few of them are left. Tags out of
+    // the beam are unreachable (see pruneBeam()), so both give the
+    // same.
+    const size_t pairs = beam_.size() * allowed_size_[i];
+    if (pairs * (table_ ? 1 : kSparseStepCost) <
+        (table_ ? table_->size() : Y * Y)) {
+      stepAllowed(i, transition);
+    } else {
+      stepViterbi(i, transition);
+      size_t t = 0;
+      for (size_t j = 0; j < Y; ++j) {
+        if (t < allowed_size_[i] && tags[t] == j) {
+          ++t;
+          continue;
+        }
+        out[j] = kUnreachable;
+        prev[j] = -1;
+      }
+    }
+    pruneBeam(i);
+    return;
+  }
+  for (size_t j = 0; j < Y; ++j) {
+    out[j] = kUnreachable;
+    prev[j] = -1;
+  }
+  // rows in ascending order of k, so that ties go to the same k as in
+  // stepViterbi()
+  for (size_t b = 0; b < beam_.size(); ++b) {
+    const size_t k = beam_[b];
+    const double *row = transition + k * Y;
+    if (table_) {
+      const unsigned short int *succ = table_->succ(k);
+      for (size_t s = 0; s < table_->succ_size(k); ++s) {
+        const size_t j = succ[s];
+        const double c = in[k] + row[j] + cost[j];
+        if (c > out[j]) {
+          out[j] = c;
+          prev[j] = static_cast<int>(k);
+        }
+      }
+      continue;
+    }
+    for (size_t j = 0; j < Y; ++j) {
+      const double c = in[k] + row[j] + cost[j];
+      const bool better = c > out[j];
+      out[j] = better ? c : out[j];
+      prev[j] = better ? static_cast<int>(k) : prev[j];
+    }
+  }
+  pruneBeam(i);
+}
+
+
+// stepBeam() into the allowed tags of position i only. The scores are
+// kept in arrays packed in the order of the allowed list, so that the
+// inner loop writes no scattered cells.
+void Lattice::stepAllowed(size_t i, const double *transition) {
+  const size_t Y = ysize_;
+  const unsigned short int *tags = allowed_[i];
+  const size_t n = allowed_size_[i];
+  const double *in = &best_[(i - 1) * Y];
+  const double *cost = emission(i);
+  packed_score_.resize(n);
+  packed_prev_.resize(n);
+  double *score = &packed_score_[0];
+  int *from = &packed_prev_[0];
+  for (size_t t = 0; t < n; ++t) {
+    score[t] = kUnreachable;
+    from[t] = -1;
+  }
+  for (size_t b = 0; b < beam_.size(); ++b) {
+    const size_t k = beam_[b];
+    const double *row = transition + k * Y;
+    const double base = in[k];
+    // max and masks instead of ?:, which compilers turn into a
+    // mispredicted branch here
+    const int kk = static_cast<int>(k);
+    for (size_t t = 0; t < n; ++t) {
+      double c = base + row[tags[t]];
+      if (table_) {
+        c += kDisallowed[table_->allowed(k, tags[t])];
+      }
+      const int better = -static_cast<int>(c > score[t]);
+      score[t] = std::max(score[t], c);
+      from[t] = (from[t] & ~better) | (kk & better);
+    }
+  }
+  double *out = &best_[i * Y];
+  int *prev = &prev_[i * Y];
+  for (size_t j = 0; j < Y; ++j) {
+    out[j] = kUnreachable;
+    prev[j] = -1;
+  }
+  for (size_t t = 0; t < n; ++t) {
+    const size_t j = tags[t];
+    out[j] = from[t] < 0 ? kUnreachable : score[t] + cost[j];
+    prev[j] = from[t];
+  }
+}
+
+void Lattice::pruneBeam(size_t i) {
+  const size_t Y = ysize_;
+  double *score = &best_[i * Y];
+  int *prev = &prev_[i * Y];
+  const unsigned short int *tags = allowed_[i];
+  const size_t size = allowed_size_[i];
+  double bestc = kUnreachable;
+  for (size_t t = 0; t < size; ++t) {
+    bestc = std::max(bestc, score[tags ? tags[t] : t]);
+  }
+
+  candidate_.resize(size);
+  const double bound = beam_threshold_ > 0.0 ? bestc - beam_threshold_ :
+      -std::numeric_limits<double>::infinity();
+  size_t n = 0;
+  for (size_t t = 0; t < size; ++t) {
+    const unsigned short int j =
+        tags ? tags[t] : static_cast<unsigned short int>(t);
+    candidate_[n] = j;
+    n += score[j] >= bound;
+  }
+  candidate_.resize(n);
+  if (beam_width_ > 0 && n > beam_width_) {
+    std::nth_element(candidate_.begin(), candidate_.begin() + beam_width_,
+                     candidate_.end(), BeamComp(score));
+    candidate_.resize(beam_width_);
+    std::sort(candidate_.begin(), candidate_.end());
+  }
+  beam_.swap(candidate_);
+
+  // no path goes through the tags out of the beam
+  if (beam_.size() < size) {
+    size_t b = 0;
+    for (size_t t = 0; t < size; ++t) {
+      const size_t j = tags ? tags[t] : t;
+      if (b < beam_.size() && beam_[b] == j) {
+        ++b;
+      } else {
+        score[j] = kUnreachable;
+        prev[j] = -1;
+      }
+    }
+  }
+}
+
+double Lattice::finishViterbi(unsigned short int *result) {
+  const size_t Y = ysize_;
+  const size_t last = size_ - 1;
+  double bestc = kUnreachable;
+  int y = -1;
+  for (size_t j = 0; j < Y; ++j) {
+    if (bestc < best_[last * Y + j]) {
+      y = static_cast<int>(j);
+      bestc = best_[last * Y + j];
+    }
+  }
+
+  if (y < 0) {
+    return kUnreachable;  // every path is disallowed or pruned
+  }
+
+  for (size_t i = last; y >= 0; --i) {
+    result[i] = y;
+    y = prev_[i * Y + y];
+  }
+
+  return bestc;
+}
+}
@@ -0,0 +1,257 @@
+//
+//  CRF++ -- Yet Another CRF toolkit
+//
+//  $Id: lattice.h $;
+//
+//  Copyright(C) 2005-2007 Taku Kudo <taku@chasen.org>
+//
+#ifndef CRFPP_LATTICE_H_
+#define CRFPP_LATTICE_H_
+
+#include <vector>
+#include <cmath>
+#include "common.h"
+
+#define LOG2               0.69314718055
+#define MINUS_LOG_EPSILON  50
+
+namespace CRFPP {
+// log(exp(x) + exp(y));
+//    this can be used recursivly
+// e.g., log(exp(log(exp(x) + exp(y))) + exp(z)) =
+// log(exp (x) + exp(y) + exp(z))
+inline double logsumexp(double x, double y, bool flg) {
+  if (flg) return y;  // init mode
+  const double vmin = std::min(x, y);
+  const double vmax = std::max(x, y);
+  if (vmax > vmin + MINUS_LOG_EPSILON) {
+    return vmax;
+  } else {
+    return vmax + std::log(std::exp(vmin - vmax) + 1.0);
+  }
+}
+
+// y[j] += x[j] for j < n. Long rows use the vector kernel of this CPU;
+// short ones are not worth the call.
+void addLongVector(size_t n, const double *x, double *y);
+
+inline void addVector(size_t n, const double *x, double *y) {
+  if (n >= 16) {
+    addLongVector(n, x, y);
+    return;
+  }
+  for (size_t j = 0; j < n; ++j) {
+    y[j] += x[j];
+  }
+}
+
+// Whitelist of tag bigrams, e.g. to forbid I-PER after B-LOC. Lattices
+// given a table visit only the allowed predecessors (or successors) of
+// each tag, in ascending order.
+class TransitionTable {
+ public:
+  // |allowed| has ysize * ysize entries; allowed[k * ysize + j] != 0 if
+  // tag k may be followed by tag j.
+  void set(size_t ysize, const std::vector<char> &allowed);
+
+  size_t ysize() const { return ysize_; }
+  // number of allowed bigrams
+  size_t size() const { return pred_.size(); }
+  bool allowed(size_t k, size_t j) const {
+    return allowed_[k * ysize_ + j] != 0;
+  }
+  const unsigned short int *pred(size_t j) const {
+    return pred_.empty() ? 0 : &pred_[pred_begin_[j]];
+  }
+  size_t pred_size(size_t j) const {
+    return pred_begin_[j + 1] - pred_begin_[j];
+  }
+  const unsigned short int *succ(size_t k) const {
+    return succ_.empty() ? 0 : &succ_[succ_begin_[k]];
+  }
+  size_t succ_size(size_t k) const {
+    return succ_begin_[k + 1] - succ_begin_[k];
+  }
+
+  TransitionTable() : ysize_(0) {}
+  virtual ~TransitionTable() {}
+
+ private:
+  size_t                          ysize_;
+  std::vector<char>               allowed_;
+  std::vector<size_t>             pred_begin_;
+  std::vector<unsigned short int> pred_;
+  std::vector<size_t>             succ_begin_;
+  std::vector<unsigned short int> succ_;
+};
+
+// Dense lattice of one sentence with size() tokens and ysize() tags.
+// Every table is a contiguous row-major array:
+//   emission(i)[j]            cost of tag j at token i
+//   transition(i)[k*ysize+j]  cost of tag k at i-1 followed by j at i
+//                             (transition(0) is free for scratch)
+//   alpha(i)[j], beta(i)[j]   forward/backward scores in log space
+//   best(i)[j], prev(i)[j]    viterbi score and back pointer
+// The storage is kept across sentences. A lattice resized with
+// |shared_transition| has a single transition matrix returned for
+// every i >= 0, for models whose transitions do not depend on the input.
+//
+// With a TransitionTable set after resize(), disallowed transitions
+// are excluded from every search and have zero marginal.
+//
+// Every search marks the nodes no path reaches, e.g. those with no
+// allowed predecessor or out of the beam, with a best() of kUnreachable
+// and a prev() of -1. prev(0) is always -1.
+//
+// forwardbackward() runs the scaled recursion in probability space when
+// the costs of every position span less than kMaxRange, so that exp()
+// is taken once per cell and no term can underflow. Otherwise it works
+// in log space. alpha() and beta() are in log space either way; after
+// the scaled recursion, their tables are filled when first read.
+class Lattice {
+ public:
+  static const double kUnreachable;
+
+  void resize(size_t size, size_t ysize, bool shared_transition);
+
+  size_t size() const  { return size_; }
+  size_t ysize() const { return ysize_; }
+
+  double *emission(size_t i) { return &emission_[i * ysize_]; }
+  const double *emission(size_t i) const { return &emission_[i * ysize_]; }
+  double *transition(size_t i) {
+    return &transition_[shared_transition_ ? 0 : i * ysize_ * ysize_];
+  }
+  const double *transition(size_t i) const {
+    return &transition_[shared_transition_ ? 0 : i * ysize_ * ysize_];
+  }
+  bool shared_transition() const { return shared_transition_; }
+  // restrict the transitions to |table| (0: all) until the next resize()
+  void set_transition_table(const TransitionTable *table) { table_ = table; }
+  const TransitionTable *transition_table() const { return table_; }
+  const double *alpha(size_t i) const {
+    if (alpha_pending_) fillAlpha();
+    return &alpha_[i * ysize_];
+  }
+  const double *beta(size_t i) const  {
+    if (beta_pending_) fillBeta();
+    return &beta_[i * ysize_];
+  }
+  const double *best(size_t i) const  { return &best_[i * ysize_]; }
+  const int *prev(size_t i) const     { return &prev_[i * ysize_]; }
+
+  // fill alpha and beta, and return log Z.
+  double forwardbackward();
+  // fill alpha alone, and return log Z. beta() and the marginals are
+  // left unset until backward().
+  double forward();
+  // fill beta after forward(); nothing to do if it is already filled.
+  void backward();
+  // whether alpha (and so Z) and beta are filled for this sentence
+  bool has_alpha() const { return has_alpha_; }
+  bool has_beta() const { return has_beta_; }
+
+  // marginals after forwardbackward(), or forward() and backward():
+  // p(y_i = j) at [j], and p(y_i-1 = k, y_i = j) at [k*ysize+j] for
+  // i >= 1. The returned row is overwritten by the next call.
+  const double *node_marginal(size_t i);
+  const double *edge_marginal(size_t i);
+  // p(y_i = j) alone
+  double marginal(size_t i, size_t j) const;
+
+  // fill best and prev, and write the best tag sequence to |result|.
+  // Returns the score of the best path, or kUnreachable, leaving
+  // |result| as it is, if no path is left.
+  double viterbi(unsigned short int *result);
+
+  // viterbi() one position at a time, for callers that compute the
+  // transition costs on the fly: startViterbi(), stepViterbi(i, costs
+  // into i) for i = 1 .. size() - 1, then finishViterbi(result).
+  void startViterbi();
+  void stepViterbi(size_t i, const double *transition);
+  double finishViterbi(unsigned short int *result);
+
+  // Beam search in place of stepViterbi(): after startBeam(), each
+  // position keeps at most |width| tags (0: all) scoring no more than
+  // |threshold| (0: any) below its best. stepBeam(i, transition) reads
+  // only the rows of |transition| of the tags kept at i - 1, listed in
+  // ascending order by beam(), and the tags dropped from the beam are
+  // unreachable. finishViterbi() ends the search.
+  void startBeam(size_t width, double threshold);
+  void stepBeam(size_t i, const double *transition);
+  // restrict the beam search at position i to the |n| tags listed in
+  // |tags| in ascending order. Every tag is allowed after resize(), and
+  // only the emission costs of allowed tags are read. |tags| must stay
+  // valid until the search ends.
+  void set_allowed(size_t i, const unsigned short int *tags, size_t n);
+  const unsigned short int *beam() const { return &beam_[0]; }
+  size_t beam_size() const { return beam_.size(); }
+
+  Lattice() : size_(0), ysize_(0), shared_transition_(false),
+              Z_(0.0), scaled_(false), has_alpha_(false),
+              has_beta_(false), alpha_pending_(false),
+              beta_pending_(false), table_(0), beam_width_(0),
+              beam_threshold_(0.0) {}
+  virtual ~Lattice() {}
+
+ private:
+  static const double kMaxRange;
+
+  bool expScaled();
+  void forwardScaled();
+  void backwardScaled();
+  void forwardLog();
+  void backwardLog();
+  void fillAlpha() const;
+  void fillBeta() const;
+  void pruneBeam(size_t i);
+  void stepAllowed(size_t i, const double *transition);
+
+  const double *ptransition(size_t i) const {
+    return &ptransition_[shared_transition_ ? 0 : i * ysize_ * ysize_];
+  }
+
+  size_t              size_;
+  size_t              ysize_;
+  bool                shared_transition_;
+  double              Z_;
+  bool                scaled_;
+  bool                has_alpha_;
+  bool                has_beta_;
+  mutable bool        alpha_pending_;  // alpha_ not filled yet
+  mutable bool        beta_pending_;
+  const TransitionTable *table_;
+  std::vector<double> emission_;
+  std::vector<double> transition_;
+  mutable std::vector<double> alpha_;
+  mutable std::vector<double> beta_;
+  std::vector<double> best_;
+  std::vector<int>    prev_;
+
+  // scaled recursion: exp(cost - max) of each position, alpha and
+  // beta normalized to sum 1 per position (beta without the emission
+  // at i), and the logs of their scales.
+  std::vector<double> pemission_;
+  std::vector<double> ptransition_;
+  std::vector<double> emission_max_;
+  std::vector<double> transition_max_;
+  std::vector<double> palpha_;
+  std::vector<double> pbeta_;
+  std::vector<double> alpha_scale_;
+  std::vector<double> beta_scale_;
+  std::vector<double> weight_;
+  std::vector<double> node_marginal_;
+  std::vector<double> edge_marginal_;
+
+  // beam search: the tags kept at the last position, and scratch
+  size_t                          beam_width_;
+  double                          beam_threshold_;
+  std::vector<unsigned short int> beam_;
+  std::vector<unsigned short int> candidate_;
+  std::vector<double>             packed_score_;
+  std::vector<int>                packed_prev_;
+  std::vector<const unsigned short int *> allowed_;  // 0: all tags
+  std::vector<size_t>                     allowed_size_;
+};
+}
+#endif
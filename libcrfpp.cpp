@@ -118,6 +118,24 @@ crfpp_t* crfpp_model_new_tagger(crfpp_model_t *c) {
       reinterpret_cast<CRFPP::Model *>(c)->createTagger());
 }
 
+int crfpp_parse_batch(crfpp_model_t *c, size_t size, const char **input,
+                      const char **output, size_t thread_num) {
+  return static_cast<int>(reinterpret_cast<CRFPP::Model *>(c)->parseBatch(
+      size, input, output, thread_num));
+}
+
+size_t crfpp_model_result_cache_hit(crfpp_model_t *c) {
+  return reinterpret_cast<CRFPP::Model *>(c)->result_cache_hit();
+}
+
+size_t crfpp_model_result_cache_miss(crfpp_model_t *c) {
+  return reinterpret_cast<CRFPP::Model *>(c)->result_cache_miss();
+}
+
+size_t crfpp_model_result_cache_eviction(crfpp_model_t *c) {
+  return reinterpret_cast<CRFPP::Model *>(c)->result_cache_eviction();
+}
+
 crfpp_t* crfpp_new(int argc, char **argv) {
   CRFPP::Tagger *tagger = CRFPP::createTagger(argc, argv);
   if (!tagger) {
@@ -155,6 +173,11 @@ int      crfpp_add2(crfpp_t* c, size_t s, const char **line) {
   return static_cast<int>(reinterpret_cast<CRFPP::Tagger *>(c)->add(s, line));
 }
 
+int      crfpp_add_borrowed(crfpp_t* c, size_t s, const char **line) {
+  return static_cast<int>(
+      reinterpret_cast<CRFPP::Tagger *>(c)->add_borrowed(s, line));
+}
+
 int      crfpp_add(crfpp_t* c, const char*s) {
   return static_cast<int>(reinterpret_cast<CRFPP::Tagger *>(c)->add(s));
 }
@@ -306,6 +329,16 @@ const char*  crfpp_tostr2(crfpp_t* c, char *ostr, size_t len) {
   return reinterpret_cast<CRFPP::Tagger *>(c)->toString(ostr, len);
 }
 
+const char*  crfpp_tobin(crfpp_t* c, size_t *len) {
+  return reinterpret_cast<CRFPP::Tagger *>(c)->toBinary(len);
+}
+
+int crfpp_to_array(crfpp_t* c, unsigned short *tags,
+                   float *marginals, size_t len) {
+  return static_cast<int>(
+      reinterpret_cast<CRFPP::Tagger *>(c)->toArray(tags, marginals, len));
+}
+
 void crfpp_set_vlevel(crfpp_t *c, unsigned int vlevel) {
   reinterpret_cast<CRFPP::Tagger *>(c)->set_vlevel(vlevel);
 }
@@ -329,3 +362,47 @@ void crfpp_set_nbest(crfpp_t *c, size_t nbest) {
 size_t crfpp_nbest(crfpp_t *c) {
   return reinterpret_cast<CRFPP::Tagger *>(c)->nbest();
 }
+
+void crfpp_set_beam(crfpp_t *c, size_t beam) {
+  reinterpret_cast<CRFPP::Tagger *>(c)->set_beam(beam);
+}
+
+size_t crfpp_beam(crfpp_t *c) {
+  return reinterpret_cast<CRFPP::Tagger *>(c)->beam();
+}
+
+void crfpp_set_beam_threshold(crfpp_t *c, double threshold) {
+  reinterpret_cast<CRFPP::Tagger *>(c)->set_beam_threshold(threshold);
+}
+
+double crfpp_beam_threshold(crfpp_t *c) {
+  return reinterpret_cast<CRFPP::Tagger *>(c)->beam_threshold();
+}
+
+void crfpp_set_marginal_level(crfpp_t *c, unsigned int level) {
+  reinterpret_cast<CRFPP::Tagger *>(c)->set_marginal_level(level);
+}
+
+unsigned int crfpp_marginal_level(crfpp_t *c) {
+  return reinterpret_cast<CRFPP::Tagger *>(c)->marginal_level();
+}
+
+size_t crfpp_unigram_cache_hit(crfpp_t *c) {
+  return reinterpret_cast<CRFPP::Tagger *>(c)->unigram_cache_hit();
+}
+
+size_t crfpp_unigram_cache_miss(crfpp_t *c) {
+  return reinterpret_cast<CRFPP::Tagger *>(c)->unigram_cache_miss();
+}
+
+size_t crfpp_result_cache_hit(crfpp_t *c) {
+  return reinterpret_cast<CRFPP::Tagger *>(c)->result_cache_hit();
+}
+
+size_t crfpp_result_cache_miss(crfpp_t *c) {
+  return reinterpret_cast<CRFPP::Tagger *>(c)->result_cache_miss();
+}
+
+size_t crfpp_result_cache_eviction(crfpp_t *c) {
+  return reinterpret_cast<CRFPP::Tagger *>(c)->result_cache_eviction();
+}
@@ -8,11 +8,15 @@
 #include <iostream>
 #include <vector>
 #include <iterator>
+#include <algorithm>
 #include <cmath>
 #include <string>
 #include <sstream>
+#include <deque>
+#include <map>
 #include "stream_wrapper.h"
 #include "common.h"
+#include "mmap.h"
 #include "tagger.h"
 
 namespace {
@@ -104,8 +108,31 @@ namespace {
 static const CRFPP::Option long_options[] = {
   {"model",  'm',  0,       "FILE",  "set FILE for model file"},
   {"nbest",  'n', "0",      "INT",   "output n-best results"},
+  {"beam",   'b', "0",      "INT",
+   "keep INT best tags per token in viterbi search (default 0: all)"},
+  {"transitions", 'T', 0, "FILE",
+   "allow only the tag bigrams listed in FILE, one \"prev next\" pair "
+   "per line"},
+  {"cascade", 'k', 0, "FILE",
+   "prune the tags of the model with the coarse model set in FILE"},
+  {"beam-threshold", 'W', "0.0", "FLOAT",
+   "drop tags scoring FLOAT below the best of the token (default 0: off)"},
+  {"marginals", 'M', "0", "INT",
+   "compute 1: the sequence probability, the marginals when printed, "
+   "2: the marginals too (default 0: 2 with -n or -v)"},
   {"verbose" , 'v', "0",    "INT",   "set INT for verbose level"},
   {"cost-factor", 'c', "1.0", "FLOAT", "set cost factor"},
+  {"unigram-cache-size", 'U', "4096", "INT",
+   "memoize ids of context-free unigram features (default 4096)"},
+  {"result-cache-size", 'R', "0", "INT",
+   "cache the results of up to INT sentences per model (default 0)"},
+  {"thread", 'p', "1", "INT",
+   "number of tagging threads (0: auto-detect, default 1)"},
+  {"binary-output", 'B', 0, 0, "output binary records instead of text"},
+  {"binary-input", 'I', 0, 0,
+   "read input files written by --convert-input"},
+  {"convert-input", 'C', 0, 0,
+   "convert text input files to the binary input format and exit"},
   {"output",         'o',  0,       "FILE",  "use FILE as output file"},
   {"version",        'v',  0,        0,       "show the version and exit" },
   {"help",   'h',  0,        0,       "show this help and exit" },
@@ -114,6 +141,157 @@ static const CRFPP::Option long_options[] = {
 }  // namespace
 
 namespace CRFPP {
+namespace {
+// FNV-1a
+unsigned long long hashKey(const std::string &key) {
+  unsigned long long h = 14695981039346656037ULL;
+  for (size_t i = 0; i < key.size(); ++i) {
+    h ^= static_cast<unsigned char>(key[i]);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+}  // namespace
+
+bool ResultCache::find(const std::string &key, Result *result) {
+  const unsigned long long h = hashKey(key);
+  scoped_lock lock(&mutex_);
+  typedef std::multimap<unsigned long long,
+      lru_type::iterator>::const_iterator const_iterator;
+  std::pair<const_iterator, const_iterator> range = index_.equal_range(h);
+  for (const_iterator it = range.first; it != range.second; ++it) {
+    if (it->second->first == key) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+      *result = it->second->second;
+      ++hit_;
+      return true;
+    }
+  }
+  ++miss_;
+  return false;
+}
+
+void ResultCache::insert(const std::string &key, const Result &result) {
+  if (size_ == 0) {
+    return;
+  }
+  const unsigned long long h = hashKey(key);
+  scoped_lock lock(&mutex_);
+  typedef std::multimap<unsigned long long,
+      lru_type::iterator>::iterator iterator;
+  std::pair<iterator, iterator> range = index_.equal_range(h);
+  for (iterator it = range.first; it != range.second; ++it) {
+    if (it->second->first == key) {
+      return;  // inserted by another tagger
+    }
+  }
+
+  lru_.push_front(std::make_pair(key, result));
+  index_.insert(std::make_pair(h, lru_.begin()));
+
+  while (lru_.size() > size_) {
+    lru_type::iterator last = --lru_.end();
+    range = index_.equal_range(hashKey(last->first));
+    for (iterator it = range.first; it != range.second; ++it) {
+      if (it->second == last) {
+        index_.erase(it);
+        break;
+      }
+    }
+    lru_.pop_back();
+    ++eviction_;
+  }
+}
+
+size_t ResultCache::hit() const {
+  scoped_lock lock(&mutex_);
+  return hit_;
+}
+
+size_t ResultCache::miss() const {
+  scoped_lock lock(&mutex_);
+  return miss_;
+}
+
+size_t ResultCache::eviction() const {
+  scoped_lock lock(&mutex_);
+  return eviction_;
+}
+
+namespace {
+// |path| relative to the directory of |filename|
+std::string relativePath(const char *filename, const std::string &path) {
+  const std::string dir(filename);
+  const std::string::size_type pos = dir.find_last_of("/\\");
+  if (pos == std::string::npos || path.empty() ||
+      path[0] == '/' || path[0] == '\\') {
+    return path;
+  }
+  return dir.substr(0, pos + 1) + path;
+}
+}  // namespace
+
+bool Cascade::open(const char *filename) {
+  std::ifstream ifs(WPATH(filename));
+  CHECK_FALSE(ifs) << "open failed: " << filename;
+
+  std::string coarse;
+  scoped_fixed_array<char, 8192> line;
+  char *column[4];
+  while (ifs.getline(line.get(), line.size())) {
+    if (line[0] == '\0' || line[0] == '#') {
+      continue;
+    }
+    const size_t size = tokenize2(line.get(), "\t ", column, 4);
+    CHECK_FALSE(size >= 2) << "format error: " << filename;
+    const std::string key(column[0]);
+    if (key == "coarse:" && size == 2) {
+      coarse = relativePath(filename, column[1]);
+    } else if (key == "model:" && size == 2) {
+      model_ = relativePath(filename, column[1]);
+    } else if (key == "threshold:" && size == 2) {
+      threshold_ = std::atof(column[1]);
+    } else if (key == "map:" && size == 3) {
+      tag_map_[column[1]] = column[2];
+    } else {
+      CHECK_FALSE(false) << "format error: " << filename;
+    }
+  }
+
+  CHECK_FALSE(!coarse.empty()) << "no coarse model: " << filename;
+  coarse_index_.reset(new DecoderFeatureIndex);
+  CHECK_FALSE(coarse_index_->open(coarse.c_str()))
+      << coarse_index_->what();
+  return true;
+}
+
+bool Cascade::map(const FeatureIndex &feature_index) {
+  const size_t csize = coarse_index_->ysize();
+  std::map<std::string, size_t> coarse_id;
+  for (size_t c = 0; c < csize; ++c) {
+    coarse_id[coarse_index_->ystr(c)] = c;
+  }
+
+  size_t mapped = 0;
+  coarse_tag_.assign(feature_index.ysize(), csize);
+  for (size_t j = 0; j < feature_index.ysize(); ++j) {
+    std::map<std::string, std::string>::const_iterator it =
+        tag_map_.find(feature_index.ystr(j));
+    const std::string &tag =
+        it == tag_map_.end() ? feature_index.ystr(j) : it->second;
+    std::map<std::string, size_t>::const_iterator c = coarse_id.find(tag);
+    if (it != tag_map_.end()) {
+      CHECK_FALSE(c != coarse_id.end()) << "unknown coarse tag: " << tag;
+      ++mapped;
+    }
+    if (c != coarse_id.end()) {
+      coarse_tag_[j] = c->second;
+    }
+  }
+  CHECK_FALSE(mapped == tag_map_.size()) << "unknown tag in map";
+
+  return true;
+}
 
 Tagger *ModelImpl::createTagger() const {
   if (!feature_index_.get()) {
@@ -121,9 +299,100 @@ Tagger *ModelImpl::createTagger() const {
   }
   TaggerImpl *tagger = new TaggerImpl;
   tagger->open(feature_index_.get(), nbest_, vlevel_);
+  tagger->set_beam(beam_);
+  tagger->set_beam_threshold(beam_threshold_);
+  tagger->set_marginal_level(marginal_level_);
+  tagger->allocator()->set_unigram_cache_size(unigram_cache_size_);
+  tagger->set_result_cache(result_cache_.get());
+  tagger->set_cascade(cascade_.get());
   return tagger;
 }
 
+namespace {
+class BatchTaggerThread : public thread {
+ public:
+  TaggerImpl *tagger;
+  const char **input;
+  std::string *output;
+  size_t start_i;
+  size_t thread_num;
+  size_t size;
+  bool ok;
+  std::string error;
+
+  void run() {
+    ok = true;
+    for (size_t i = start_i; i < size; i += thread_num) {
+      const char *result = tagger->parse(input[i]);
+      if (!result) {
+        ok = false;
+        error = tagger->what();
+        return;
+      }
+      output[i] = result;
+    }
+  }
+};
+}  // namespace
+
+ModelImpl::~ModelImpl() {
+  for (size_t i = 0; i < batch_tagger_.size(); ++i) {
+    delete batch_tagger_[i];
+  }
+}
+
+bool ModelImpl::parseBatch(size_t size, const char **input,
+                           const char **output, size_t thread_num) {
+  CHECK_FALSE(feature_index_.get()) << "model is not opened";
+  if (size == 0) {
+    return true;
+  }
+
+  scoped_lock lock(&batch_mutex_);
+  if (thread_num == 0) {
+    thread_num = getCpuCount();
+  }
+  thread_num = std::max<size_t>(1, std::min(thread_num, size));
+
+  while (batch_tagger_.size() < thread_num) {
+    batch_tagger_.push_back(static_cast<TaggerImpl *>(createTagger()));
+  }
+
+  batch_output_.resize(size);
+  std::vector<BatchTaggerThread> threads(thread_num);
+  for (size_t i = 0; i < thread_num; ++i) {
+    threads[i].tagger = batch_tagger_[i];
+    threads[i].input = input;
+    threads[i].output = &batch_output_[0];
+    threads[i].start_i = i;
+    threads[i].thread_num = thread_num;
+    threads[i].size = size;
+  }
+
+#ifdef CRFPP_USE_THREAD
+  for (size_t i = 0; i < thread_num; ++i) {
+    threads[i].start();
+  }
+  for (size_t i = 0; i < thread_num; ++i) {
+    threads[i].join();
+  }
+#else
+  for (size_t i = 0; i < thread_num; ++i) {
+    threads[i].run();
+  }
+#endif
+
+  for (size_t i = 0; i < thread_num; ++i) {
+    CHECK_FALSE(threads[i].ok) << threads[i].error;
+  }
+
+  for (size_t i = 0; i < size; ++i) {
+    output[i] = batch_output_[i].c_str();
+  }
+
+  return true;
+}
+
 bool TaggerImpl::open(FeatureIndex *feature_index,
                       Allocator *allocator) {
   close();
@@ -147,34 +416,95 @@ bool TaggerImpl::open(FeatureIndex *feature_index,
   return true;
 }
 
+namespace {
+// Open the cascade file given by |param|, if any, and set |model| to
+// the full model it names. Returns 0 if there is none or on failure,
+// which sets |error|.
+Cascade *openCascade(const Param &param, std::string *model,
+                     std::string *error) {
+  const std::string filename = param.get<std::string>("cascade");
+  if (filename.empty()) {
+    return 0;
+  }
+  Cascade *cascade = new Cascade;
+  if (!cascade->open(filename.c_str())) {
+    *error = cascade->what();
+    delete cascade;
+    return 0;
+  }
+  if (std::strlen(cascade->model()) > 0) {
+    *model = cascade->model();
+  }
+  return cascade;
+}
+}  // namespace
+
 bool ModelImpl::openFromArray(const Param &param,
                               const char *buf,
                               size_t size) {
-  nbest_ = param.get<int>("nbest");
-  vlevel_ = param.get<int>("verbose");
+  std::string model;
+  std::string error;
+  cascade_.reset(openCascade(param, &model, &error));
+  if (!error.empty()) {
+    WHAT << error;
+    return false;
+  }
+  if (!model.empty()) {
+    WHAT << "a cascade file cannot name the model of a model array: "
+         << param.get<std::string>("cascade");
+    cascade_.reset(0);
+    return false;
+  }
   feature_index_.reset(new DecoderFeatureIndex);
   if (!feature_index_->openFromArray(buf, size)) {
     WHAT << feature_index_->what();
     feature_index_.reset(0);
     return false;
   }
-  const double c = param.get<double>("cost-factor");
-  feature_index_->set_cost_factor(c);
-  return true;
+  return configure(param);
 }
 
 bool ModelImpl::open(const Param &param) {
-  nbest_ = param.get<int>("nbest");
-  vlevel_ = param.get<int>("verbose");
-  const std::string model = param.get<std::string>("model");
+  std::string model = param.get<std::string>("model");
+  std::string error;
+  cascade_.reset(openCascade(param, &model, &error));
+  if (!error.empty()) {
+    WHAT << error;
+    return false;
+  }
   feature_index_.reset(new DecoderFeatureIndex);
   if (!feature_index_->open(model.c_str())) {
     WHAT << feature_index_->what();
     feature_index_.reset(0);
     return false;
   }
+  return configure(param);
+}
+
+bool ModelImpl::configure(const Param &param) {
+  nbest_ = param.get<int>("nbest");
+  vlevel_ = param.get<int>("verbose");
+  beam_ = param.get<int>("beam");
+  beam_threshold_ = param.get<double>("beam-threshold");
+  marginal_level_ = param.get<int>("marginals");
+  unigram_cache_size_ = param.get<int>("unigram-cache-size");
   const double c = param.get<double>("cost-factor");
   feature_index_->set_cost_factor(c);
+  const std::string transitions = param.get<std::string>("transitions");
+  if (!transitions.empty() &&
+      !feature_index_->openTransitionTable(transitions.c_str())) {
+    WHAT << feature_index_->what();
+    feature_index_.reset(0);
+    return false;
+  }
+  if (cascade_.get() && !cascade_->map(*feature_index_)) {
+    WHAT << cascade_->what();
+    feature_index_.reset(0);
+    return false;
+  }
+  const int result_cache_size = param.get<int>("result-cache-size");
+  result_cache_.reset(result_cache_size > 0 ?
+                      new ResultCache(result_cache_size) : 0);
   return true;
 }
 
@@ -223,8 +553,18 @@ bool TaggerImpl::open(const Param &param) {
 
   nbest_ = param.get<int>("nbest");
   vlevel_ = param.get<int>("verbose");
+  beam_ = param.get<int>("beam");
+  beam_threshold_ = param.get<double>("beam-threshold");
+  marginal_level_ = param.get<int>("marginals");
 
   std::string model = param.get<std::string>("model");
+  std::string error;
+  cascade_ = openCascade(param, &model, &error);
+  if (!error.empty()) {
+    WHAT << error;
+    close();
+    return false;
+  }
 
   DecoderFeatureIndex *decoder_feature_index = new DecoderFeatureIndex;
   feature_index_ = decoder_feature_index;
@@ -236,6 +576,12 @@ bool TaggerImpl::open(const Param &param) {
     return false;
   }
 
+  if (cascade_ && !cascade_->map(*feature_index_)) {
+    WHAT << cascade_->what();
+    close();
+    return false;
+  }
+
   const double c = param.get<double>("cost-factor");
 
   if (c <= 0.0) {
@@ -246,6 +592,18 @@ bool TaggerImpl::open(const Param &param) {
 
   feature_index_->set_cost_factor(c);
   ysize_ = feature_index_->ysize();
+  const std::string transitions = param.get<std::string>("transitions");
+  if (!transitions.empty() &&
+      !feature_index_->openTransitionTable(transitions.c_str())) {
+    WHAT << feature_index_->what();
+    close();
+    return false;
+  }
+  allocator_->set_unigram_cache_size(param.get<int>("unigram-cache-size"));
+  const int result_cache_size = param.get<int>("result-cache-size");
+  if (result_cache_size > 0) {
+    result_cache_ = new ResultCache(result_cache_size);
+  }
 
   return true;
 }
@@ -264,15 +622,21 @@ bool TaggerImpl::open(const char *arg) {
 }
 
 void TaggerImpl::close() {
+  coarse_tagger_.reset(0);
   if (mode_ == TEST) {
     delete feature_index_;
     delete allocator_;
+    delete cascade_;
+    delete result_cache_;
     feature_index_ = 0;
     allocator_ = 0;
   } else if (mode_ == TEST_SHARED) {
     delete allocator_;
     allocator_ = 0;
   }
+  cascade_ = 0;
+  result_cache_ = 0;
+  cached_ = false;
 }
 
 bool TaggerImpl::set_model(const Model &model) {
@@ -280,6 +644,8 @@ bool TaggerImpl::set_model(const Model &model) {
     // feature_index_ => took the owner
     // allocator_ => reuse
     delete feature_index_;
+    delete cascade_;
+    delete result_cache_;
   } else if (mode_ == LEARN) {
     // feature_index_ => did not take the owner
     // allocator_ => did not take the owner.
@@ -293,7 +659,13 @@ bool TaggerImpl::set_model(const Model &model) {
   feature_index_ = model_impl->feature_index();
   nbest_ = model_impl->nbest();
   vlevel_ = model_impl->vlevel();
+  beam_ = model_impl->beam();
+  beam_threshold_ = model_impl->beam_threshold();
+  marginal_level_ = model_impl->marginal_level();
   ysize_ = feature_index_->ysize();
+  allocator_->set_unigram_cache_size(model_impl->unigram_cache_size());
+  result_cache_ = model_impl->result_cache();
+  set_cascade(model_impl->cascade());
   return true;
 }
 
@@ -307,13 +679,13 @@ bool TaggerImpl::add2(size_t size, const char **column, bool copy) {
                        << size << " xsize=" << xsize;
   }
 
-  size_t s = x_.size() + 1;
-	// 统一列表长度
-	x_.resize(s);
-  node_.resize(s);
-  answer_.resize(s);
-  result_.resize(s);
-  s = x_.size() - 1;
+  const size_t s = size_++;
+  if (x_.size() < size_) {
+    x_.resize(size_);
+  }
+  answer_.resize(size_);
+  result_.resize(size_);
+  x_[s].clear();
 
   if (copy) {  // 是否拷贝
     for (size_t k = 0; k < size; ++k) {
@@ -339,8 +711,6 @@ bool TaggerImpl::add2(size_t size, const char **column, bool copy) {
     answer_[s] = r;
   }
 
-  node_[s].resize(ysize_);
-
   return true;
 }
 
@@ -348,15 +718,45 @@ bool TaggerImpl::add(size_t size, const char **column) {
   return add2(size, column, true);
 }
 
+bool TaggerImpl::add_borrowed(size_t size, const char **column) {
+  return add2(size, column, false);
+}
+
 bool TaggerImpl::add(const char* line) {
-  char *p = allocator_->strdup(line);  // 复制这个字符串
-  scoped_fixed_array<const char *, 8192> column;  // 这里面存储的是改行的待分词字符
-  //计算这一行的列数 size，并把p中的第一列的值，返回给column.get()中:这正是待分词的文本字符
-  const size_t size = tokenize2(p, "\t ", column.get(), column.size());
-  // std::cout << "这个column[0]是：" << column[0] << std::endl;
-  if (!add2(size, column.get(), false)) {  // false:是否拷贝
-    return false;
+  return addLine(allocator_->strdup(line));  // 复制这个字符串
+}
+
+// tokenize |line| in place; columns point into |line|.
+bool TaggerImpl::addLine(char *line) {
+  std::vector<const char *> &column = *allocator_->column_buffer();
+  if (column.empty()) {
+    column.resize(8192);
   }
+  const size_t size = tokenize2(line, "\t ", column.begin(), column.size());
+  return add2(size, &column[0], false);
+}
+
+// Same as read(), but splits |input| in a per-tagger buffer which
+// x_ points into, so that no copy is made per line or column.
+bool TaggerImpl::readBuffer(const char *input, size_t length) {
+  clear();
+  input_buffer_.assign(input, input + length);
+  input_buffer_.push_back('\0');
+
+  char *p = &input_buffer_[0];
+  char *end = p + length;
+  while (p < end) {
+    char *eol = std::find(p, end, '\n');
+    *eol = '\0';
+    if (p[0] == '\0' || p[0] == ' ' || p[0] == '\t') {
+      break;
+    }
+    if (!addLine(p)) {
+      return false;
+    }
+    p = eol + 1;
+  }
+
   return true;
 }
 
@@ -386,7 +786,7 @@ bool TaggerImpl::read(std::istream *is) {
 
 void TaggerImpl::set_penalty(size_t i, size_t j, double penalty) {
   if (penalty_.empty()) {
-    penalty_.resize(node_.size());
+    penalty_.resize(size_);
     for (size_t s = 0; s < penalty_.size(); ++s) {
       penalty_[s].resize(ysize_);
     }
@@ -403,7 +803,6 @@ bool TaggerImpl::shrink() {
   CHECK_FALSE(feature_index_->buildFeatures(this))  // this 调用着自身的实例
       << feature_index_->what();
   std::vector<std::vector<const char *> >(x_).swap(x_);
-  std::vector<std::vector<Node *> >(node_).swap(node_);
   std::vector<unsigned short int>(answer_).swap(answer_);
   std::vector<unsigned short int>(result_).swap(result_);
 
@@ -411,57 +810,141 @@ bool TaggerImpl::shrink() {
 }
 
 bool TaggerImpl::initNbest() {
-  if (!agenda_.get()) {
-    agenda_.reset(new std::priority_queue <QueueElement*,
-                  std::vector<QueueElement *>, QueueElementComp>);
-    nbest_freelist_.reset(new FreeList <QueueElement>(128));
+  const size_t nodes = size_ * ysize_ + 1;
+  if (kbest_.size() < nodes) {
+    kbest_.resize(nodes);
+    kbest_candidate_.resize(nodes);
+  }
+  for (size_t v = 0; v < nodes; ++v) {
+    kbest_[v].clear();
+    kbest_candidate_[v].clear();
+  }
+  kbest_init_.assign(nodes, 0);
+  kbest_rank_ = 0;
+  return true;
+}
+
+// score of extending a derivation of (i - 1, y) scoring |score| to
+// (i, j); i == size() is the end of the path.
+double TaggerImpl::kbestScore(size_t i, size_t j, size_t y,
+                              double score) const {
+  if (i == size_) {
+    return score;
   }
+  const Lattice *lattice = this->lattice();
+  return score + lattice->transition(i)[y * ysize_ + j] +
+      lattice->emission(i)[j];
+}
 
-  nbest_freelist_->free();
-  while (!agenda_->empty()) {
-    agenda_->pop();   // make empty
+// Make the derivation of node (i, j) of the given rank available in
+// kbest_, and return false if there is none. The candidates of a node
+// are only built when a derivation past the viterbi one is asked for.
+bool TaggerImpl::findKbest(size_t i, size_t j, size_t rank) {
+  if (i == 0) {
+    return rank == 0;
+  }
+  const size_t v = i * ysize_ + j;
+  std::vector<Derivation> &found = kbest_[v];
+  std::vector<Derivation> &candidate = kbest_candidate_[v];
+  const Lattice *lattice = this->lattice();
+  if (!kbest_init_[v]) {
+    kbest_init_[v] = 1;
+    const TransitionTable *table = lattice->transition_table();
+    // i == size() ends the path at any tag of the last token
+    const int best = i == size_ ? -1 : lattice->prev(i)[j];
+    if (i < size_ && best < 0) {
+      return false;  // no allowed transition into (i, j)
+    }
+    const double *from = lattice->best(i - 1);
+    for (size_t y = 0; y < ysize_; ++y) {
+      // no path reaches the tags of i - 1 scoring kUnreachable
+      if (static_cast<int>(y) == best || from[y] <= Lattice::kUnreachable ||
+          (i < size_ && table && !table->allowed(y, j))) {
+        continue;
+      }
+      Derivation d;
+      d.score = kbestScore(i, j, y, from[y]);
+      d.rank = 0;
+      d.y = static_cast<unsigned short int>(y);
+      candidate.push_back(d);
+    }
+    std::make_heap(candidate.begin(), candidate.end(), DerivationComp());
+    if (best >= 0) {
+      Derivation d;
+      d.score = lattice->best(i)[j];
+      d.rank = 0;
+      d.y = static_cast<unsigned short int>(best);
+      found.push_back(d);
+      extendKbest(i, j, d);
+    }
   }
 
-  const size_t k = x_.size()-1;
-  for (size_t i = 0; i < ysize_; ++i) {
-    QueueElement *eos = nbest_freelist_->alloc();
-    eos->node = node_[k][i];
-    eos->fx = -node_[k][i]->bestCost;
-    eos->gx = -node_[k][i]->cost;
-    eos->next = 0;
-    agenda_->push(eos);
+  while (found.size() <= rank && !candidate.empty()) {
+    std::pop_heap(candidate.begin(), candidate.end(), DerivationComp());
+    const Derivation d = candidate.back();
+    candidate.pop_back();
+    found.push_back(d);
+    extendKbest(i, j, d);
   }
 
-  return true;
+  return found.size() > rank;
 }
 
-bool TaggerImpl::next() {
-  while (!agenda_->empty()) {
-    QueueElement *top = agenda_->top();
-    agenda_->pop();
-    Node *rnode = top->node;
+// Add the next derivation of (i, j) through the same tag at i - 1 as
+// |d| to the candidates of (i, j).
+void TaggerImpl::extendKbest(size_t i, size_t j, Derivation d) {
+  if (!findKbest(i - 1, d.y, d.rank + 1)) {
+    return;
+  }
+  ++d.rank;
+  d.score = kbestScore(i, j, d.y,
+                       kbest_[(i - 1) * ysize_ + d.y][d.rank].score);
+  std::vector<Derivation> &candidate = kbest_candidate_[i * ysize_ + j];
+  candidate.push_back(d);
+  std::push_heap(candidate.begin(), candidate.end(), DerivationComp());
+}
 
-    if (rnode->x == 0) {
-      for (QueueElement *n = top; n; n = n->next) {
-        result_[n->node->x] = n->node->y;
-      }
-      cost_ = top->gx;
-      return true;
+bool TaggerImpl::next() {
+  if (cached_) {
+    const size_t size = size_;
+    if (cached_nbest_ + 1 >= cache_result_.cost.size()) {
+      return false;
     }
+    ++cached_nbest_;  // path 0 is the viterbi path
+    std::copy(cache_result_.y.begin() + cached_nbest_ * size,
+              cache_result_.y.begin() + (cached_nbest_ + 1) * size,
+              result_.begin());
+    cost_ = cache_result_.cost[cached_nbest_];
+    return true;
+  }
 
-    for (const_Path_iterator it = rnode->lpath.begin();
-         it != rnode->lpath.end(); ++it) {
-      QueueElement *n =nbest_freelist_->alloc();
-      n->node = (*it)->lnode;
-      n->gx   = -(*it)->lnode->cost     -(*it)->cost +  top->gx;
-      n->fx   = -(*it)->lnode->bestCost -(*it)->cost +  top->gx;
-      //          |              h(x)                 |  |  g(x)  |
-      n->next = top;
-      agenda_->push(n);
+  if (kbest_init_.size() != size_ * ysize_ + 1 ||
+      !findKbest(size_, 0, kbest_rank_)) {
+    return false;
+  }
+
+  // follow the derivations back; those of rank 0 are the viterbi
+  // back pointers
+  const Lattice *lattice = this->lattice();
+  const Derivation &end = kbest_[size_ * ysize_][kbest_rank_++];
+  size_t y = end.y;
+  size_t rank = end.rank;
+  for (size_t i = size_ - 1; ; --i) {
+    result_[i] = y;
+    if (i == 0) {
+      break;
+    }
+    if (rank == 0) {
+      y = lattice->prev(i)[y];
+    } else {
+      const Derivation &d = kbest_[i * ysize_ + y][rank];
+      y = d.y;
+      rank = d.rank;
     }
   }
+  cost_ = -end.score;
 
-  return 0;
+  return true;
 }
 
 int TaggerImpl::eval() {
@@ -469,7 +952,7 @@ int TaggerImpl::eval() {
 	// 返回本句子所有行中预测错误的个数
   int err = 0;
 	// 逐个比较 一个句子中的每个行([the, DT, B]) 的预测准确情况
-  for (size_t i = 0; i < x_.size(); ++i) {
+  for (size_t i = 0; i < size_; ++i) {
     if (answer_[i] != result_[i]) {
       ++err;
     }
@@ -481,140 +964,311 @@ bool TaggerImpl::clear() {
   if (mode_ == TEST || mode_ == TEST_SHARED) {
     allocator_->clear();
   }
-  x_.clear();
-  node_.clear();
+  size_ = 0;
   answer_.clear();
   result_.clear();
   Z_ = cost_ = 0.0;
+  cached_ = false;
+  cached_nbest_ = 0;
   return true;
 }
 
 void TaggerImpl::buildLattice() {
 	// 构建篱笆图，然后计算nide/path的代价
-  if (x_.empty()) {
+  if (size_ == 0) {
     return;
   }
 
-  feature_index_->rebuildFeatures(this);  // 构建这个句子的篱笆图
-
-  for (size_t i = 0; i < x_.size(); ++i) {
-    for (size_t j = 0; j < ysize_; ++j) {
+  const bool shared = feature_index_->static_bigram();
+  Lattice *lattice = resizeLattice(shared);
+  buildEmission(false);
 
-	    // 计算 状态特征函数(点)  的代价
-	    feature_index_->calcCost(node_[i][j]);
+	// 计算 转移特征函数(边) 的代价
+  const size_t ysize2 = ysize_ * ysize_;
+  if (shared) {
+    if (size_ > 1) {
+      feature_index_->calcCost(static_bigram_vector(), ysize2,
+                               lattice->transition(1));
+    }
+  } else if (size_ > 1) {
+    // sum the position-independent features once; transition(0) is free.
+    const int *f = static_bigram_vector();
+    size_t n = 0;
+    while (f[n] != -1) ++n;
+    double *sum = lattice->transition(0);
+    feature_index_->sumCost(f, ysize2, sum);
+    for (size_t i = 1; i < size_; ++i) {
+      feature_index_->calcCost(bigram_vector(i) + n, sum, ysize2,
+                               lattice->transition(i));
+    }
+  }
+}
 
+// Training always sees every transition; decoding is restricted to the
+// transition table of the model, if any.
+Lattice *TaggerImpl::resizeLattice(bool shared_transition) {
+  Lattice *lattice = this->lattice();
+  lattice->resize(size_, ysize_, shared_transition);
+  if (mode_ != LEARN) {
+    lattice->set_transition_table(feature_index_->transition_table());
+  }
+  return lattice;
+}
 
-	    // 获取这个节点(x,y)的 左连接边 列表
-      const std::vector<Path *> &lpath = node_[i][j]->lpath;
-      for (const_Path_iterator it = lpath.begin(); it != lpath.end(); ++it) {
-	      // 计算 转移特征函数(边) 的代价
-	      feature_index_->calcCost(*it);  // 逐个计算其左连接边的代价
-      }
+void TaggerImpl::buildEmission(bool prune) {
+  Lattice *lattice = this->lattice();
+  const bool cascade = prune && cascade_;
+  prune = prune && feature_index_->has_tag_dictionary();
+	// 计算 状态特征函数(点)  的代价
+  for (size_t i = 0; i < size_; ++i) {
+    size_t n = 0;
+    const unsigned short *tags = 0;
+    if (cascade) {
+      n = cascade_begin_[i + 1] - cascade_begin_[i];
+      tags = n < ysize_ ? &cascade_tag_[cascade_begin_[i]] : 0;
+    } else if (prune) {
+      tags = feature_index_->allowedTags(x_[i][0], &n);
+    }
+    if (tags) {
+      lattice->set_allowed(i, tags, n);
+      feature_index_->calcSparseCost(unigram_vector(i), tags, n,
+                                     lattice->emission(i));
+    } else {
+      feature_index_->calcCost(unigram_vector(i), ysize_,
+                               lattice->emission(i));
     }
   }
 
   // Add penalty for Dual decomposition.
   if (!penalty_.empty()) {  // 如果罚项不为空，就为每个节点增加代价
-    for (size_t i = 0; i < x_.size(); ++i) {
+    for (size_t i = 0; i < size_; ++i) {
+      double *cost = lattice->emission(i);
       for (size_t j = 0; j < ysize_; ++j) {
-        node_[i][j]->cost += penalty_[i][j];
+        cost[j] += penalty_[i][j];
       }
     }
   }
 }
 
-void TaggerImpl::forwardbackward() {
-  if (x_.empty()) {
-    return;
-  }
-	// 计算节点alpha
-  for (int i = 0; i < static_cast<int>(x_.size()); ++i) {
-    for (size_t j = 0; j < ysize_; ++j) {
-      node_[i][j]->calcAlpha();
+// Viterbi without the per-position transition tables: the lattice keeps
+// a single Y x Y matrix, refilled for each position when the bigram
+// features depend on the input.
+bool TaggerImpl::viterbiLean() {
+  Lattice *lattice = resizeLattice(true);
+  buildEmission(false);
+
+  const size_t ysize2 = ysize_ * ysize_;
+  double *trans = lattice->transition(0);
+  lattice->startViterbi();
+  if (feature_index_->static_bigram()) {
+    if (size_ > 1) {
+      feature_index_->calcCost(static_bigram_vector(), ysize2, trans);
     }
-  }
-	//计算节点bata
-  for (int i = static_cast<int>(x_.size() - 1); i >= 0;  --i) {
-    for (size_t j = 0; j < ysize_; ++j) {
-      node_[i][j]->calcBeta();
+    for (size_t i = 1; i < size_; ++i) {
+      lattice->stepViterbi(i, trans);
+    }
+  } else if (size_ > 1) {
+    const int *f = static_bigram_vector();
+    size_t n = 0;
+    while (f[n] != -1) ++n;
+    transition_sum_.resize(ysize2);
+    feature_index_->sumCost(f, ysize2, &transition_sum_[0]);
+    for (size_t i = 1; i < size_; ++i) {
+      feature_index_->calcCost(bigram_vector(i) + n, &transition_sum_[0],
+                               ysize2, trans);
+      lattice->stepViterbi(i, trans);
     }
   }
+  return setBestPath(lattice->finishViterbi(&result_[0]));
+}
 
-	// 计算Z(x)
-  Z_ = 0.0;
-  for (size_t j = 0; j < ysize_; ++j) {
-    Z_ = logsumexp(Z_, node_[0][j]->beta, j == 0);
+// Beam-pruned viterbi (see Lattice::startBeam()), over the tags of the
+// tag dictionary if the model has one. When the bigram features depend
+// on the input, only the transition rows of the tags kept at the
+// previous token are computed.
+bool TaggerImpl::viterbiBeam() {
+  Lattice *lattice = resizeLattice(true);
+  buildEmission(true);
+
+  double *trans = lattice->transition(0);
+  const bool shared = feature_index_->static_bigram();
+  if (shared && size_ > 1) {
+    feature_index_->calcCost(static_bigram_vector(), ysize_ * ysize_, trans);
   }
-
-  return;
+  lattice->startBeam(beam_, beam_threshold_);
+  for (size_t i = 1; i < size_; ++i) {
+    if (!shared && lattice->beam_size() == ysize_) {
+      feature_index_->calcCost(bigram_vector(i), ysize_ * ysize_, trans);
+    } else if (!shared) {
+      // row k of the costs starts at k * ysize of every bigram feature
+      const unsigned short int *beam = lattice->beam();
+      for (size_t b = 0; b < lattice->beam_size(); ++b) {
+        const int offset = static_cast<int>(beam[b] * ysize_);
+        beam_feature_.clear();
+        for (const int *f = bigram_vector(i); *f != -1; ++f) {
+          beam_feature_.push_back(*f + offset);
+        }
+        beam_feature_.push_back(-1);
+        feature_index_->calcCost(&beam_feature_[0], ysize_, trans + offset);
+      }
+    }
+    lattice->stepBeam(i, trans);
+  }
+  return setBestPath(lattice->finishViterbi(&result_[0]));
 }
 
-void TaggerImpl::viterbi() {
-	// viterbi算法
-  for (size_t i = 0;   i < x_.size(); ++i) {
-    for (size_t j = 0; j < ysize_; ++j) {
-      double bestc = -1e37;
-      Node *best = 0;
-      const std::vector<Path *> &lpath = node_[i][j]->lpath;
-      for (const_Path_iterator it = lpath.begin(); it != lpath.end(); ++it) {
-        double cost = (*it)->lnode->bestCost +(*it)->cost +
-            node_[i][j]->cost;
-        if (cost > bestc) {
-          bestc = cost;
-          best  = (*it)->lnode;
+// Keep at each token the tags whose coarse tag has a marginal of at
+// least the threshold, and the tags of the best coarse one. Tags the
+// tag dictionary rules out are dropped too, unless none would be left.
+bool TaggerImpl::buildCascade() {
+  if (!coarse_tagger_.get()) {
+    coarse_tagger_.reset(new TaggerImpl);
+    coarse_tagger_->open(cascade_->coarse_index(), 0, 0);
+  }
+  TaggerImpl *coarse = coarse_tagger_.get();
+  coarse->clear();
+  for (size_t i = 0; i < size_; ++i) {
+    CHECK_FALSE(coarse->add_borrowed(x_[i].size(),
+                                     const_cast<const char **>(&x_[i][0])))
+        << coarse->what();
+  }
+  CHECK_FALSE(coarse->feature_index_->buildFeatures(coarse))
+      << coarse->feature_index_->what();
+  coarse->buildLattice();
+  coarse->forwardbackward();
+
+  Lattice *lattice = coarse->lattice();
+  const size_t csize = coarse->ysize();
+  const double threshold = cascade_->threshold();
+  const bool dictionary = feature_index_->has_tag_dictionary();
+  coarse_keep_.resize(csize + 1);
+  coarse_keep_[csize] = 1;  // tags without a coarse tag
+  cascade_tag_.clear();
+  cascade_begin_.resize(size_ + 1);
+  for (size_t i = 0; i < size_; ++i) {
+    const double *p = lattice->node_marginal(i);
+    size_t best = 0;
+    for (size_t c = 0; c < csize; ++c) {
+      coarse_keep_[c] = p[c] >= threshold;
+      if (p[c] > p[best]) best = c;
+    }
+    coarse_keep_[best] = 1;
+
+    cascade_begin_[i] = cascade_tag_.size();
+    size_t n = 0;
+    const unsigned short *tags =
+        dictionary ? feature_index_->allowedTags(x_[i][0], &n) : 0;
+    if (tags) {
+      for (size_t k = 0; k < n; ++k) {
+        if (coarse_keep_[cascade_->coarse_tag(tags[k])]) {
+          cascade_tag_.push_back(tags[k]);
+        }
+      }
+      if (cascade_tag_.size() == cascade_begin_[i]) {
+        cascade_tag_.insert(cascade_tag_.end(), tags, tags + n);
+      }
+    } else {
+      for (size_t j = 0; j < ysize_; ++j) {
+        if (coarse_keep_[cascade_->coarse_tag(j)]) {
+          cascade_tag_.push_back(static_cast<unsigned short int>(j));
+        }
+      }
+      if (cascade_tag_.size() == cascade_begin_[i]) {
+        for (size_t j = 0; j < ysize_; ++j) {
+          cascade_tag_.push_back(static_cast<unsigned short int>(j));
         }
       }
-      node_[i][j]->prev     = best;
-      node_[i][j]->bestCost = best ? bestc : node_[i][j]->cost;
     }
   }
+  cascade_begin_[size_] = cascade_tag_.size();
 
-  double bestc = -1e37;
-  Node *best = 0;
-  size_t s = x_.size()-1;
-  for (size_t j = 0; j < ysize_; ++j) {
-    if (bestc < node_[s][j]->bestCost) {
-      best  = node_[s][j];
-      bestc = node_[s][j]->bestCost;
-    }
+  return true;
+}
+
+unsigned int TaggerImpl::marginalLevel() const {
+  if (marginal_level_ == 0) {
+    return nbest_ || vlevel_ >= 1 ? 2 : 0;
+  }
+  // n-best paths are searched in the full lattice, and printed with
+  // prob()
+  return nbest_ ? std::max(marginal_level_, 1U) : marginal_level_;
+}
+
+// Below level 2, the backward pass runs when a marginal is first read.
+// Without the forward pass, there is nothing to read.
+double TaggerImpl::prob(size_t i, size_t j) const {
+  if (cached_) {
+    return cache_result_.prob.empty() ? 0.0 :
+        cache_result_.prob[i * ysize_ + j];
   }
+  Lattice *lattice = this->lattice();
+  if (!lattice->has_alpha()) {
+    return 0.0;
+  }
+  lattice->backward();
+  return lattice->marginal(i, j);
+}
 
-  for (Node *n = best; n; n = n->prev) {
-    result_[n->x] = n->y;  // 把viterbi预测的结果队列提取保存出来
+void TaggerImpl::forwardbackward() {
+  if (size_ == 0) {
+    return;
   }
+	// 计算节点alpha, bata 和 Z(x)
+  Z_ = lattice()->forwardbackward();
+}
+
+bool TaggerImpl::viterbi() {
+	// viterbi算法
+	// 把viterbi预测的结果队列提取保存出来
+  return setBestPath(lattice()->viterbi(&result_[0]));
+}
 
-  cost_ = -node_[x_.size()-1][result_[x_.size()-1]]->bestCost;
+bool TaggerImpl::setBestPath(double score) {
+  CHECK_FALSE(score > Lattice::kUnreachable)
+      << "no path is allowed by the transition table, tag dictionary "
+      << "or beam";
+  cost_ = -score;
+  return true;
 }
 
 double TaggerImpl::gradient(double *expected) {
-  if (x_.empty()) return 0.0;  // 这是一个空句子,直接返回
+  if (size_ == 0) return 0.0;  // 这是一个空句子,直接返回
 
   buildLattice();  // 构建篱笆图，然后计算node、path的罚项代价
   forwardbackward();  // 前向后向算法:计算节点的alpha,beat和Z(x)
+  Lattice *lattice = this->lattice();
   double s = 0.0;
 
   //  下面利用前后向算法的结果 计算 P(y|x)
-  for (size_t i = 0;   i < x_.size(); ++i) {
-    for (size_t j = 0; j < ysize_; ++j) {
-      node_[i][j]->calcExpectation(expected, Z_, ysize_);
+  const size_t ysize2 = ysize_ * ysize_;
+  for (size_t i = 0;   i < size_; ++i) {
+    // p(Y_i=y_i | x)
+    const double *p = lattice->node_marginal(i);
+    for (const int *f = unigram_vector(i); *f != -1; ++f) {
+      addVector(ysize_, p, expected + *f);
+    }
+    if (i == 0) {
+      continue;
+    }
+    // p(Y_i-1 = y_i-1 ,Y_i=y_i | x)
+    p = lattice->edge_marginal(i);
+    for (const int *f = bigram_vector(i); *f != -1; ++f) {
+      addVector(ysize2, p, expected + *f);
     }
   }
 
 	// 计算梯度
-  for (size_t i = 0;   i < x_.size(); ++i) {
-    for (const int *f = node_[i][answer_[i]]->fvector; *f != -1; ++f) {
+  for (size_t i = 0;   i < size_; ++i) {
+    for (const int *f = unigram_vector(i); *f != -1; ++f) {
       --expected[*f + answer_[i]];
     }
-    s += node_[i][answer_[i]]->cost;  // UNIGRAM cost
-    const std::vector<Path *> &lpath = node_[i][answer_[i]]->lpath;
-    for (const_Path_iterator it = lpath.begin(); it != lpath.end(); ++it) {
-      if ((*it)->lnode->y == answer_[(*it)->lnode->x]) {
-        for (const int *f = (*it)->fvector; *f != -1; ++f) {
-          --expected[*f +(*it)->lnode->y * ysize_ +(*it)->rnode->y];
-        }
-        s += (*it)->cost;  // BIGRAM COST
-        break;
+    s += lattice->emission(i)[answer_[i]];  // UNIGRAM cost
+    if (i > 0) {
+      const size_t y = answer_[i - 1] * ysize_ + answer_[i];
+      for (const int *f = bigram_vector(i); *f != -1; ++f) {
+        --expected[*f + y];
       }
+      s += lattice->transition(i)[y];  // BIGRAM COST
     }
   }
 
@@ -624,62 +1278,57 @@ double TaggerImpl::gradient(double *expected) {
 }
 
 double TaggerImpl::collins(double *collins) {
-  if (x_.empty()) {
+  if (size_ == 0) {
     return 0.0;
   }
 
   buildLattice();
   viterbi();  // call for finding argmax y*
+  const Lattice *lattice = this->lattice();
   double s = 0.0;
 
   // if correct parse, do not run forward + backward
   {
     size_t num = 0;
-    for (size_t i = 0; i < x_.size(); ++i) {
+    for (size_t i = 0; i < size_; ++i) {
       if (answer_[i] == result_[i]) {
         ++num;
       }
     }
 
-    if (num == x_.size()) return 0.0;
+    if (num == size_) return 0.0;
   }
 
-  for (size_t i = 0; i < x_.size(); ++i) {
+  for (size_t i = 0; i < size_; ++i) {
     // answer
     {
-      s += node_[i][answer_[i]]->cost;
-      for (const int *f = node_[i][answer_[i]]->fvector; *f != -1; ++f) {
+      s += lattice->emission(i)[answer_[i]];
+      for (const int *f = unigram_vector(i); *f != -1; ++f) {
         ++collins[*f + answer_[i]];
       }
 
-      const std::vector<Path *> &lpath = node_[i][answer_[i]]->lpath;
-      for (const_Path_iterator it = lpath.begin(); it != lpath.end(); ++it) {
-        if ((*it)->lnode->y == answer_[(*it)->lnode->x]) {
-          for (const int *f = (*it)->fvector; *f != -1; ++f) {
-            ++collins[*f +(*it)->lnode->y * ysize_ +(*it)->rnode->y];
-          }
-          s += (*it)->cost;
-          break;
+      if (i > 0) {
+        const size_t y = answer_[i - 1] * ysize_ + answer_[i];
+        for (const int *f = bigram_vector(i); *f != -1; ++f) {
+          ++collins[*f + y];
         }
+        s += lattice->transition(i)[y];
       }
     }
 
     // result
     {
-      s -= node_[i][result_[i]]->cost;
-      for (const int *f = node_[i][result_[i]]->fvector; *f != -1; ++f) {
+      s -= lattice->emission(i)[result_[i]];
+      for (const int *f = unigram_vector(i); *f != -1; ++f) {
         --collins[*f + result_[i]];
       }
 
-      const std::vector<Path *> &lpath = node_[i][result_[i]]->lpath;
-      for (const_Path_iterator it = lpath.begin(); it != lpath.end(); ++it) {
-        if ((*it)->lnode->y == result_[(*it)->lnode->x]) {
-          for (const int *f = (*it)->fvector; *f != -1; ++f) {
-            --collins[*f +(*it)->lnode->y * ysize_ +(*it)->rnode->y];
-          }
-          s -= (*it)->cost;
-          break;
+      if (i > 0) {
+        const size_t y = result_[i - 1] * ysize_ + result_[i];
+        for (const int *f = bigram_vector(i); *f != -1; ++f) {
+          --collins[*f + y];
         }
+        s -= lattice->transition(i)[y];
       }
     }
   }
@@ -687,20 +1336,106 @@ double TaggerImpl::collins(double *collins) {
   return -s;
 }
 
+void TaggerImpl::makeCacheKey(std::string *key) const {
+  key->clear();
+  for (size_t i = 0; i < size_; ++i) {
+    for (size_t j = 0; j < x_[i].size(); ++j) {
+      key->append(x_[i][j]);
+      key->push_back('\t');
+    }
+    key->push_back('\n');
+  }
+  std::ostringstream os;
+  os << nbest_ << ' ' << vlevel_ << ' ' << feature_index_->cost_factor()
+     << ' ' << beam_ << ' ' << beam_threshold_ << ' ' << marginal_level_;
+  key->append(os.str());
+}
+
+// Copy the viterbi path, the n-best paths and the marginals into
+// cache_result_. Since the n-best agenda is consumed here, the rest of
+// this sentence is served from cache_result_ too.
+void TaggerImpl::storeCacheResult() {
+  const size_t size = size_;
+  cache_result_.y.assign(result_.begin(), result_.end());
+  cache_result_.cost.assign(1, cost_);
+  cache_result_.Z = Z_;
+  cache_result_.prob.clear();
+  if (marginalLevel() >= 1) {
+    cache_result_.prob.resize(size * ysize_);
+    for (size_t i = 0; i < size; ++i) {
+      for (size_t j = 0; j < ysize_; ++j) {
+        cache_result_.prob[i * ysize_ + j] = prob(i, j);
+      }
+    }
+  }
+
+  if (nbest_) {
+    const std::vector<unsigned short int> best(result_);
+    const double best_cost = cost_;
+    for (size_t n = 0; n < nbest_ && next(); ++n) {
+      cache_result_.y.insert(cache_result_.y.end(),
+                             result_.begin(), result_.end());
+      cache_result_.cost.push_back(cost_);
+    }
+    result_ = best;
+    cost_ = best_cost;
+  }
+
+  result_cache_->insert(cache_key_, cache_result_);
+  cached_ = true;
+  cached_nbest_ = 0;
+}
+
 bool TaggerImpl::parse() {
+  const bool use_cache = result_cache_ && penalty_.empty() && size_ > 0;
+  if (use_cache) {
+    makeCacheKey(&cache_key_);
+    if (result_cache_->find(cache_key_, &cache_result_)) {
+      std::copy(cache_result_.y.begin(),
+                cache_result_.y.begin() + size_, result_.begin());
+      cost_ = cache_result_.cost[0];
+      Z_ = cache_result_.Z;
+      cached_ = true;
+      cached_nbest_ = 0;
+      return true;
+    }
+  }
+
   CHECK_FALSE(feature_index_->buildFeatures(this))
       << feature_index_->what();
 
-  if (x_.empty()) {
+  if (size_ == 0) {
     return true;
   }
-  buildLattice();
-  if (nbest_ || vlevel_ >= 1) {
-    forwardbackward();
+  const unsigned int level = marginalLevel();
+  if (level >= 1) {
+    buildLattice();
+    if (level >= 2) {
+      forwardbackward();
+    } else {
+      Z_ = lattice()->forward();
+    }
+    if (!viterbi()) {
+      return false;
+    }
+    if (nbest_) {
+      initNbest();
+    }
+  } else if (cascade_) {
+    if (!buildCascade() || !viterbiBeam()) {
+      return false;
+    }
+  } else if (beam_ > 0 || beam_threshold_ > 0.0 ||
+             feature_index_->has_tag_dictionary()) {
+    if (!viterbiBeam()) {
+      return false;
+    }
+  } else if (!viterbiLean()) {
+    return false;
   }
-  viterbi();
-  if (nbest_) {
-    initNbest();
+
+  if (use_cache) {
+    storeCacheResult();
   }
 
   return true;
@@ -711,8 +1446,7 @@ const char* TaggerImpl::parse(const char* input) {
 }
 
 const char* TaggerImpl::parse(const char* input, size_t length) {
-  std::istringstream is(std::string(input, length));
-  if (!read(&is) || !parse()) {
+  if (!readBuffer(input, length) || !parse()) {
     return 0;
   }
   toString();
@@ -721,8 +1455,7 @@ const char* TaggerImpl::parse(const char* input, size_t length) {
 
 const char* TaggerImpl::parse(const char*input, size_t len1,
                               char *output, size_t len2) {
-  std::istringstream is(std::string(input, len1));
-  if (x_.empty()) {
+  if (!readBuffer(input, len1) || !parse() || size_ == 0) {
     return 0;
   }
   toString();
@@ -740,7 +1473,7 @@ bool TaggerImpl::parse_stream(std::istream *is,
   if (!read(is) || !parse()) {
     return false;
   }
-  if (x_.empty()) {
+  if (size_ == 0) {
     return true;
   }
   toString();
@@ -756,23 +1489,117 @@ const char* TaggerImpl::toString(char *output,
   return output;
 }
 
-const char* TaggerImpl::toString() {
+// Append the current result to os_. At vlevel >= 2, the marginals of
+// each token are computed once into prob_buffer_.
+void TaggerImpl::printSentence() {
+  for (size_t i = 0; i < size_; ++i) {
+    for (std::vector<const char*>::const_iterator it = x_[i].begin();
+         it != x_[i].end(); ++it) {
+      os_.append(*it);
+      os_.push_back('\t');
+    }
+    os_.append(feature_index_->ystr(result_[i]));
+    if (vlevel_ >= 2) {
+      prob_buffer_.resize(ysize_);
+      for (size_t j = 0; j < ysize_; ++j) {
+        prob_buffer_[j] = prob(i, j);
+      }
+      os_ << '/' << prob_buffer_[result_[i]];
+      for (size_t j = 0; j < ysize_; ++j) {
+        os_.push_back('\t');
+        os_.append(feature_index_->ystr(j));
+        os_ << '/' << prob_buffer_[j];
+      }
+    } else if (vlevel_ >= 1) {
+      os_ << '/' << prob(i);
+    }
+    os_.push_back('\n');
+  }
+  os_.push_back('\n');
+}
+
+namespace {
+const char kBinaryMagic[] = "CRFB";
+const unsigned int kBinaryVersion = 1;
+
+enum { BINARY_PROB = 1, BINARY_MARGINALS = 2 };
+
+template <class T>
+void appendBinary(std::string *os, T value) {
+  os->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+}  // namespace
+
+const char* TaggerImpl::binaryHeader(size_t *size) {
+  os_.assign(kBinaryMagic, 4);
+  appendBinary(&os_, kBinaryVersion);
+  appendBinary(&os_, static_cast<unsigned int>(ysize_));
+  for (size_t j = 0; j < ysize_; ++j) {
+    os_.append(feature_index_->ystr(j));
+    os_.push_back('\0');
+  }
+  *size = os_.size();
+  return os_.data();
+}
+
+void TaggerImpl::printBinary(size_t rank) {
+  unsigned short flags = 0;
+  if (vlevel_ >= 1) flags |= BINARY_PROB;
+  if (vlevel_ >= 2) flags |= BINARY_MARGINALS;
+  appendBinary(&os_, static_cast<unsigned int>(size_));
+  appendBinary(&os_, static_cast<unsigned short>(rank));
+  appendBinary(&os_, flags);
+  if (flags & BINARY_PROB) {
+    appendBinary(&os_, static_cast<float>(prob()));
+  }
+  os_.append(reinterpret_cast<const char *>(&result_[0]),
+             size_ * sizeof(result_[0]));
+  if (flags & BINARY_MARGINALS) {
+    for (size_t i = 0; i < size_; ++i) {
+      for (size_t j = 0; j < ysize_; ++j) {
+        appendBinary(&os_, static_cast<float>(prob(i, j)));
+      }
+    }
+  }
+}
+
+const char* TaggerImpl::toBinary(size_t *size) {
   os_.assign("");
+  if (size_ == 0) {
+    // no record for an empty sentence
+  } else if (nbest_ >= 1) {
+    for (size_t n = 0; n < nbest_; ++n) {
+      if (!next()) {
+        break;
+      }
+      printBinary(n);
+    }
+  } else {
+    printBinary(0);
+  }
+  *size = os_.size();
+  return os_.data();
+}
+
+bool TaggerImpl::toArray(unsigned short *tags, float *marginals,
+                         size_t size) {
+  CHECK_FALSE(size >= size_) << "buffer is too small: size=" << size
+                             << " required=" << size_;
+  CHECK_FALSE(!marginals || marginalLevel() >= 1)
+      << "marginals require nbest, verbose level >= 1 or marginal level >= 1";
+  std::copy(result_.begin(), result_.begin() + size_, tags);
+  if (marginals) {
+    for (size_t i = 0; i < size_; ++i) {
+      for (size_t j = 0; j < ysize_; ++j) {
+        *marginals++ = static_cast<float>(prob(i, j));
+      }
+    }
+  }
+  return true;
+}
 
-#define PRINT                                                   \
-  for (size_t i = 0; i < x_.size(); ++i) {                      \
-    for (std::vector<const char*>::iterator it = x_[i].begin(); \
-         it != x_[i].end(); ++it)                               \
-      os_ << *it << '\t';                                       \
-    os_ << yname(y(i));                                         \
-    if (vlevel_ >= 1) os_ << '/' << prob(i);                    \
-    if (vlevel_ >= 2) {                                         \
-      for (size_t j = 0; j < ysize_; ++j)                       \
-        os_ << '\t' << yname(j) << '/' << prob(i, j);           \
-    }                                                           \
-    os_ << '\n';                                                \
-  }                                                             \
-  os_ << '\n';
+const char* TaggerImpl::toString() {
+  os_.assign("");
 
   if (nbest_ >= 1) {
     for (size_t n = 0; n < nbest_; ++n) {
@@ -780,18 +1607,16 @@ const char* TaggerImpl::toString() {
         break;
       }
       os_ << "# " << n << " " << prob() << '\n';
-      PRINT;
+      printSentence();
     }
   } else {
     if (vlevel_ >= 1) {
       os_ << "# " << prob() << '\n';
     }
-    PRINT;
+    printSentence();
   }
 
   return const_cast<const char*>(os_.c_str());
-
-#undef PRINT
 }
 
 Tagger *createTagger(int argc, char **argv) {
@@ -865,6 +1690,489 @@ const char *getLastError() {
 }
 
 namespace {
+// Binary input format written by --convert-input and read by
+// --binary-input. Integers are unsigned int in native byte order.
+//   "CRFI" version
+//   sentences: size() xsize ids[size() * xsize]
+//   string table: NUL-terminated strings, in the order of their ids
+//   trailer: string count, offset of the string table (unsigned long long)
+// The string table comes last so that the converter can stream.
+const char kCorpusMagic[] = "CRFI";
+const unsigned int kCorpusVersion = 1;
+const size_t kCorpusHeaderSize = 8;
+const size_t kCorpusTrailerSize = 12;
+
+class BinaryCorpus {
+ public:
+  bool open(const char *filename) {
+    CHECK_FALSE(mmap_.open(filename)) << mmap_.what();
+    const char *begin = mmap_.begin();
+    const size_t size = mmap_.file_size();
+    CHECK_FALSE(size >= kCorpusHeaderSize + kCorpusTrailerSize &&
+                std::memcmp(begin, kCorpusMagic, 4) == 0 &&
+                read32(begin + 4) == kCorpusVersion)
+        << "invalid binary input: " << filename;
+
+    const char *trailer = begin + size - kCorpusTrailerSize;
+    const unsigned int string_size = read32(trailer);
+    unsigned long long table_offset = 0;
+    std::memcpy(&table_offset, trailer + 4, sizeof(table_offset));
+    CHECK_FALSE(table_offset >= kCorpusHeaderSize &&
+                table_offset <= size - kCorpusTrailerSize)
+        << "invalid binary input: " << filename;
+
+    strings_.resize(string_size);
+    const char *p = begin + table_offset;
+    for (size_t i = 0; i < string_size; ++i) {
+      const char *nul = static_cast<const char *>(
+          std::memchr(p, '\0', trailer - p));
+      CHECK_FALSE(nul) << "broken string table: " << filename;
+      strings_[i] = p;
+      p = nul + 1;
+    }
+
+    cur_ = begin + kCorpusHeaderSize;
+    end_ = begin + table_offset;
+
+    // check every record, so that next() and add() stay in the file
+    for (const char *q = cur_; q < end_; ) {
+      const size_t offset = q - begin;
+      CHECK_FALSE(end_ - q >= 8)
+          << "broken record at offset " << offset << ": " << filename;
+      const unsigned long long n =
+          static_cast<unsigned long long>(read32(q)) * read32(q + 4);
+      CHECK_FALSE(n <= static_cast<size_t>(end_ - q - 8) / 4)
+          << "broken record at offset " << offset << ": " << filename;
+      q += 8;
+      for (const char *e = q + 4 * n; q < e; q += 4) {
+        CHECK_FALSE(read32(q) < string_size)
+            << "unknown string id in record at offset " << offset << ": "
+            << filename;
+      }
+    }
+    return true;
+  }
+
+  // set the next sentence to [*begin, *end); return false at the end.
+  bool next(const char **begin, const char **end) {
+    if (cur_ == end_) {
+      return false;
+    }
+    const size_t n = static_cast<size_t>(read32(cur_)) * read32(cur_ + 4);
+    *begin = cur_;
+    cur_ += 8 + 4 * n;
+    *end = cur_;
+    return true;
+  }
+
+  // add the sentence [begin, end) to |tagger|. The columns point into
+  // the string table, which lives as long as this object.
+  bool add(const char *begin, const char *end,
+           std::vector<const char *> *column, TaggerImpl *tagger) const {
+    const size_t size = read32(begin);
+    const size_t xsize = read32(begin + 4);
+    if (static_cast<size_t>(end - begin) != 8 + 4 * size * xsize) {
+      return false;  // not a record returned by next()
+    }
+    column->resize(xsize);
+    const char *p = begin + 8;
+    for (size_t i = 0; i < size; ++i) {
+      for (size_t j = 0; j < xsize; ++j, p += 4) {
+        (*column)[j] = strings_[read32(p)];
+      }
+      if (!tagger->add_borrowed(xsize, xsize ? &(*column)[0] : 0)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const char *what() { return what_.str(); }
+
+  BinaryCorpus() : cur_(0), end_(0) {}
+
+ private:
+  static unsigned int read32(const char *p) {
+    unsigned int n = 0;
+    std::memcpy(&n, p, sizeof(n));
+    return n;
+  }
+
+  Mmap<char>                mmap_;
+  std::vector<const char *> strings_;
+  const char               *cur_;
+  const char               *end_;
+  whatlog                   what_;
+};
+
+template <class T>
+void writeCorpus(std::ostream *os, T n) {
+  os->write(reinterpret_cast<const char *>(&n), sizeof(n));
+}
+
+// convert text input |files| to the binary input format.
+bool convertCorpus(const std::vector<std::string> &files,
+                   std::ostream *os, std::string *error) {
+  std::map<std::string, unsigned int> dic;
+  std::vector<const std::string *> strings;
+  std::vector<unsigned int> ids;
+  size_t size = 0;
+  size_t xsize = 0;
+  unsigned long long offset = kCorpusHeaderSize;
+  scoped_fixed_array<char, 8192> line;
+  scoped_fixed_array<char *, 8192> column;
+
+  os->write(kCorpusMagic, 4);
+  writeCorpus(os, kCorpusVersion);
+
+#define FLUSH_SENTENCE do {                                             \
+    if (size > 0) {                                                     \
+      writeCorpus(os, static_cast<unsigned int>(size));                 \
+      writeCorpus(os, static_cast<unsigned int>(xsize));                \
+      os->write(reinterpret_cast<const char *>(&ids[0]),                \
+                ids.size() * sizeof(ids[0]));                           \
+      offset += 8 + 4 * ids.size();                                     \
+    }                                                                   \
+    size = xsize = 0;                                                   \
+    ids.clear(); } while (0)
+
+  for (size_t i = 0; i < files.size(); ++i) {
+    istream_wrapper is(files[i].c_str());
+    if (!*is) {
+      *error = "no such file or directory: " + files[i];
+      return false;
+    }
+    while (is->getline(line.get(), line.size())) {
+      if (line[0] == '\0' || line[0] == ' ' || line[0] == '\t') {
+        FLUSH_SENTENCE;
+        continue;
+      }
+      const size_t n = tokenize2(line.get(), "\t ",
+                                 column.get(), column.size());
+      if (size > 0 && n != xsize) {
+        *error = "column size mismatch in a sentence: " + files[i];
+        return false;
+      }
+      xsize = n;
+      ++size;
+      for (size_t j = 0; j < n; ++j) {
+        std::map<std::string, unsigned int>::iterator it =
+            dic.insert(std::make_pair(std::string(column[j]),
+                                      static_cast<unsigned int>(
+                                          strings.size()))).first;
+        if (it->second == strings.size()) {
+          strings.push_back(&it->first);
+        }
+        ids.push_back(it->second);
+      }
+    }
+    FLUSH_SENTENCE;
+  }
+#undef FLUSH_SENTENCE
+
+  for (size_t i = 0; i < strings.size(); ++i) {
+    os->write(strings[i]->c_str(), strings[i]->size() + 1);
+  }
+  writeCorpus(os, static_cast<unsigned int>(strings.size()));
+  writeCorpus(os, offset);
+  return true;
+}
+
+// Sentences read but not yet written. The reader stops when
+// kMaxPendingSize * thread_num sentences are pending, which bounds both
+// the input queue and the reorder buffer of the writer.
+const size_t kMaxPendingSize = 64;
+
+// A sentence is either |text| or a record [begin, end) of |corpus|.
+struct TestSentence {
+  size_t              id;
+  const BinaryCorpus *corpus;
+  const char         *begin;
+  const char         *end;
+  std::string         text;
+};
+
+struct TestPipeline {
+  mutex mutex_;
+  condition input_ready;   // reader => taggers
+  condition output_ready;  // taggers => writer
+  condition space_ready;   // writer => reader
+  std::deque<TestSentence> input;
+  std::map<size_t, std::string> output;
+  size_t read_size;
+  size_t write_size;
+  size_t max_pending_size;
+  bool eof;
+  bool binary_input;
+  bool binary_output;
+  std::string error;
+  // Set when a sentence fails to tag: nothing is read or tagged any
+  // more, and the output stops before sentence |stop_id|.
+  bool stop;
+  size_t stop_id;
+};
+
+class TestReaderThread : public thread {
+ public:
+  TestPipeline *pipeline;
+  const std::vector<std::string> *files;
+
+  std::vector<BinaryCorpus *> corpora;  // kept until the taggers finish
+
+  virtual ~TestReaderThread() {
+    for (size_t i = 0; i < corpora.size(); ++i) {
+      delete corpora[i];
+    }
+  }
+
+  // return false once the pipeline is stopped.
+  bool push(std::string *text, const BinaryCorpus *corpus,
+            const char *begin, const char *end) {
+    if (!corpus && text->empty()) {
+      return true;
+    }
+    scoped_lock lock(&pipeline->mutex_);
+    while (pipeline->read_size - pipeline->write_size >=
+           pipeline->max_pending_size && !pipeline->stop) {
+      pipeline->space_ready.wait(&pipeline->mutex_);
+    }
+    if (pipeline->stop) {
+      return false;
+    }
+    pipeline->input.push_back(TestSentence());
+    TestSentence &sentence = pipeline->input.back();
+    sentence.id = pipeline->read_size++;
+    sentence.corpus = corpus;
+    sentence.begin = begin;
+    sentence.end = end;
+    if (text) {
+      sentence.text.swap(*text);
+    }
+    pipeline->input_ready.signal();
+    return true;
+  }
+
+  // return false to stop reading, on an error or a stopped pipeline.
+  bool readCorpus(const std::string &file) {
+    BinaryCorpus *corpus = new BinaryCorpus;
+    corpora.push_back(corpus);
+    if (!corpus->open(file.c_str())) {
+      scoped_lock lock(&pipeline->mutex_);
+      pipeline->error = corpus->what();
+      return false;
+    }
+    const char *begin = 0;
+    const char *end = 0;
+    while (corpus->next(&begin, &end)) {
+      if (!push(0, corpus, begin, end)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // split sentences in the same way as TaggerImpl::read()
+  void run() {
+    scoped_fixed_array<char, 8192> line;
+    std::string sentence;
+    bool ok = true;
+    for (size_t i = 0; ok && i < files->size(); ++i) {
+      if (pipeline->binary_input) {
+        ok = readCorpus((*files)[i]);
+        continue;
+      }
+      istream_wrapper is((*files)[i].c_str());
+      if (!*is) {
+        scoped_lock lock(&pipeline->mutex_);
+        pipeline->error = "no such file or directory: " + (*files)[i];
+        break;
+      }
+      while (ok && is->getline(line.get(), line.size())) {
+        if (line[0] == '\0' || line[0] == ' ' || line[0] == '\t') {
+          ok = push(&sentence, 0, 0, 0);
+          continue;
+        }
+        sentence.append(line.get());
+        sentence.push_back('\n');
+      }
+      ok = ok && push(&sentence, 0, 0, 0);
+    }
+
+    scoped_lock lock(&pipeline->mutex_);
+    pipeline->eof = true;
+    pipeline->input_ready.broadcast();
+    pipeline->output_ready.signal();
+  }
+};
+
+class TestTaggerThread : public thread {
+ public:
+  TestPipeline *pipeline;
+  TaggerImpl *tagger;
+
+  void run() {
+    TestSentence sentence;
+    std::vector<const char *> column;
+    for (;;) {
+      {
+        scoped_lock lock(&pipeline->mutex_);
+        while (pipeline->input.empty() && !pipeline->eof &&
+               !pipeline->stop) {
+          pipeline->input_ready.wait(&pipeline->mutex_);
+        }
+        if (pipeline->input.empty() || pipeline->stop) {
+          return;
+        }
+        TestSentence &front = pipeline->input.front();
+        sentence.id = front.id;
+        sentence.corpus = front.corpus;
+        sentence.begin = front.begin;
+        sentence.end = front.end;
+        sentence.text.swap(front.text);
+        pipeline->input.pop_front();
+      }
+
+      bool ok = false;
+      if (sentence.corpus) {
+        tagger->clear();
+        ok = sentence.corpus->add(sentence.begin, sentence.end,
+                                  &column, tagger) && tagger->parse();
+      } else {
+        ok = tagger->readBuffer(sentence.text.data(),
+                                sentence.text.size()) && tagger->parse();
+      }
+
+      scoped_lock lock(&pipeline->mutex_);
+      if (!ok) {
+        // keep the error of the first sentence in the input
+        if (!pipeline->stop || sentence.id < pipeline->stop_id) {
+          pipeline->error = tagger->what();
+          pipeline->stop_id = sentence.id;
+        }
+        pipeline->stop = true;
+        pipeline->input_ready.broadcast();
+        pipeline->output_ready.signal();
+        pipeline->space_ready.signal();
+        return;
+      }
+      std::string &output = pipeline->output[sentence.id];
+      if (pipeline->binary_output) {
+        size_t size = 0;
+        const char *result = tagger->toBinary(&size);
+        output.assign(result, size);
+      } else {
+        output.assign(tagger->toString());
+      }
+      pipeline->output_ready.signal();
+    }
+  }
+};
+
+class TestWriterThread : public thread {
+ public:
+  TestPipeline *pipeline;
+  std::ostream *os;
+
+  void run() {
+    std::string output;
+    for (;;) {
+      {
+        scoped_lock lock(&pipeline->mutex_);
+        std::map<size_t, std::string>::iterator it;
+        while ((it = pipeline->output.find(pipeline->write_size)) ==
+               pipeline->output.end()) {
+          if ((pipeline->eof &&
+               pipeline->write_size == pipeline->read_size) ||
+              (pipeline->stop &&
+               pipeline->write_size == pipeline->stop_id)) {
+            return;
+          }
+          pipeline->output_ready.wait(&pipeline->mutex_);
+        }
+        output.swap(it->second);
+        pipeline->output.erase(it);
+        ++pipeline->write_size;
+        pipeline->space_ready.signal();
+      }
+      os->write(output.data(), output.size());
+    }
+  }
+};
+
+int crfpp_test_thread(const Param &param, size_t thread_num,
+                      std::ostream *os,
+                      const std::vector<std::string> &files) {
+  ModelImpl model;
+  if (!model.open(param)) {
+    std::cerr << model.what() << std::endl;
+    return -1;
+  }
+
+  TestPipeline pipeline;
+  pipeline.read_size = pipeline.write_size = 0;
+  pipeline.max_pending_size = kMaxPendingSize * thread_num;
+  pipeline.eof = false;
+  pipeline.stop = false;
+  pipeline.stop_id = 0;
+  pipeline.binary_input = param.get<bool>("binary-input");
+  pipeline.binary_output = param.get<bool>("binary-output");
+
+  std::vector<TaggerImpl *> taggers(thread_num);
+  std::vector<TestTaggerThread> tagger_threads(thread_num);
+  for (size_t i = 0; i < thread_num; ++i) {
+    taggers[i] = static_cast<TaggerImpl *>(model.createTagger());
+    tagger_threads[i].pipeline = &pipeline;
+    tagger_threads[i].tagger = taggers[i];
+  }
+
+  if (pipeline.binary_output) {
+    size_t size = 0;
+    const char *header = taggers[0]->binaryHeader(&size);
+    os->write(header, size);
+  }
+
+  TestReaderThread reader;
+  reader.pipeline = &pipeline;
+  reader.files = &files;
+  TestWriterThread writer;
+  writer.pipeline = &pipeline;
+  writer.os = os;
+
+  reader.start();
+  for (size_t i = 0; i < thread_num; ++i) {
+    tagger_threads[i].start();
+  }
+  writer.start();
+
+  reader.join();
+  for (size_t i = 0; i < thread_num; ++i) {
+    tagger_threads[i].join();
+    delete taggers[i];
+  }
+  writer.join();
+
+  if (!pipeline.error.empty()) {
+    std::cerr << pipeline.error << std::endl;
+    return -1;
+  }
+
+  return 0;
+}
+
+void writeResult(TaggerImpl *tagger, bool binary_output, std::ostream *os) {
+  if (tagger->empty()) {
+    return;
+  }
+  if (binary_output) {
+    size_t size = 0;
+    const char *result = tagger->toBinary(&size);
+    os->write(result, size);
+  } else {
+    const char *result = tagger->toString();
+    os->write(result, std::strlen(result));
+  }
+}
+
 int crfpp_test(const Param &param) {
   if (param.get<bool>("version")) {
     std::cout <<  param.version();
@@ -876,10 +2184,11 @@ int crfpp_test(const Param &param) {
     return -1;
   }
 
-  CRFPP::TaggerImpl tagger;
-  if (!tagger.open(param)) {
-    std::cerr << tagger.what() << std::endl;
-    return -1;
+  const bool binary_input = param.get<bool>("binary-input");
+  const bool binary_output = param.get<bool>("binary-output");
+  size_t thread_num = param.get<size_t>("thread");
+  if (thread_num == 0) {
+    thread_num = getCpuCount();
   }
 
   std::string output = param.get<std::string>("output");
@@ -899,14 +2208,70 @@ int crfpp_test(const Param &param) {
     rest.push_back("-");
   }
 
+  if (param.get<bool>("convert-input")) {
+    std::string error;
+    if (!convertCorpus(rest, os.get(), &error)) {
+      std::cerr << error << std::endl;
+      return -1;
+    }
+    return 0;
+  }
+
+#ifdef CRFPP_USE_THREAD
+  if (thread_num > 1) {
+    return crfpp_test_thread(param, thread_num, os.get(), rest);
+  }
+#endif
+
+  CRFPP::TaggerImpl tagger;
+  if (!tagger.open(param)) {
+    std::cerr << tagger.what() << std::endl;
+    return -1;
+  }
+
+  if (binary_output) {
+    size_t size = 0;
+    const char *header = tagger.binaryHeader(&size);
+    os->write(header, size);
+  }
+
   for (size_t i = 0; i < rest.size(); ++i) {
+    if (binary_input) {
+      BinaryCorpus corpus;
+      if (!corpus.open(rest[i].c_str())) {
+        std::cerr << corpus.what() << std::endl;
+        return -1;
+      }
+      std::vector<const char *> column;
+      const char *begin = 0;
+      const char *end = 0;
+      while (corpus.next(&begin, &end)) {
+        tagger.clear();
+        if (!corpus.add(begin, end, &column, &tagger) || !tagger.parse()) {
+          std::cerr << tagger.what() << std::endl;
+          return -1;
+        }
+        writeResult(&tagger, binary_output, os.get());
+      }
+      continue;
+    }
+
     CRFPP::istream_wrapper is(rest[i].c_str());
     if (!*is) {
       std::cerr << "no such file or directory: " << rest[i] << std::endl;
       return -1;
     }
     while (*is) {
-      tagger.parse_stream(is.get(), os.get());
+      const bool ok = binary_output ?
+          tagger.read(is.get()) && tagger.parse() :
+          tagger.parse_stream(is.get(), os.get());
+      if (!ok) {
+        std::cerr << tagger.what() << std::endl;
+        return -1;
+      }
+      if (binary_output) {
+        writeResult(&tagger, binary_output, os.get());
+      }
     }
   }
 
@@ -10,56 +10,163 @@
 
 #include <iostream>
 #include <vector>
-#include <queue>
+#include <list>
+#include <map>
 #include "param.h"
 #include "crfpp.h"
 #include "scoped_ptr.h"
+#include "thread.h"
 #include "feature_index.h"
 
 namespace CRFPP {
 
-static inline double toprob(Node *n, double Z) {
-  return std::exp(n->alpha + n->beta - n->cost - Z);
-}
-
 class Allocator;
+class TaggerImpl;
+
+// LRU cache of tagging results shared by the taggers of one model.
+// Keys are the input columns plus the decoding options.
+class ResultCache {
+ public:
+  struct Result {
+    std::vector<unsigned short int> y;     // size() tags per n-best path
+    std::vector<double>             cost;  // cost of each path
+    std::vector<double>             prob;  // size() * ysize() marginals
+    double                          Z;
+  };
+
+  // copy the result for |key| to |result| if cached.
+  bool find(const std::string &key, Result *result);
+  void insert(const std::string &key, const Result &result);
+
+  size_t hit() const;
+  size_t miss() const;
+  size_t eviction() const;
+
+  explicit ResultCache(size_t size)
+      : size_(size), hit_(0), miss_(0), eviction_(0) {}
+  virtual ~ResultCache() {}
+
+ private:
+  typedef std::list<std::pair<std::string, Result> > lru_type;
+  size_t                 size_;
+  size_t                 hit_;
+  size_t                 miss_;
+  size_t                 eviction_;
+  lru_type               lru_;  // most recently used first
+  std::multimap<unsigned long long, lru_type::iterator> index_;
+  mutable mutex          mutex_;
+};
+
+// Coarse-to-fine decoding. A cascade file pairs the full model with a
+// cheap coarse one, one "key: value" per line:
+//   coarse: FILE         model with few templates or a coarse tag set
+//   model: FILE          full model (default: --model); not allowed
+//                        when the model is opened from an array
+//   threshold: FLOAT     coarse marginal below which tags are pruned
+//   map: TAG COARSE_TAG  coarse tag of a full model tag; by default,
+//                        the coarse tag of the same name, if any
+// Relative paths are taken from the directory of the cascade file.
+// The full model searches only the tags whose coarse tag keeps a
+// marginal of at least the threshold at that token; tags without a
+// coarse tag are never pruned. n-best and verbose decoding ignore the
+// cascade, since they need the whole lattice.
+class Cascade {
+ public:
+  // read |filename| and open the coarse model.
+  bool open(const char *filename);
+  // map the tags of the full model to the coarse ones.
+  bool map(const FeatureIndex &feature_index);
+
+  const char *model() const { return model_.c_str(); }
+  FeatureIndex *coarse_index() const { return coarse_index_.get(); }
+  double threshold() const { return threshold_; }
+  // coarse tag of tag j of the full model; coarse_index()->ysize()
+  // if none
+  size_t coarse_tag(size_t j) const { return coarse_tag_[j]; }
+  const char *what() { return what_.str(); }
+
+  Cascade() : threshold_(0.0) {}
+  virtual ~Cascade() {}
+
+ private:
+  whatlog                             what_;
+  std::string                         model_;
+  double                              threshold_;
+  std::map<std::string, std::string>  tag_map_;
+  std::vector<size_t>                 coarse_tag_;
+  scoped_ptr<DecoderFeatureIndex>     coarse_index_;
+};
 
 class ModelImpl : public Model {
  public:
-  ModelImpl() : nbest_(0), vlevel_(0) {}
-  virtual ~ModelImpl() {}
+  ModelImpl() : nbest_(0), vlevel_(0), beam_(0), beam_threshold_(0.0),
+                marginal_level_(0), unigram_cache_size_(0) {}
+  virtual ~ModelImpl();
   bool open(int argc,  char** argv);
   bool open(const char* arg);
   bool openFromArray(int argc,  char** argv,
                      const char *buf, size_t size);
   bool openFromArray(const char* arg,
                      const char *buf, size_t size);
+  bool open(const Param &param);
   Tagger *createTagger() const;
+  bool parseBatch(size_t size, const char **input,
+                  const char **output, size_t thread_num);
   const char* what() { return what_.str(); }
 
   unsigned int nbest() const { return nbest_; }
   unsigned int vlevel() const { return vlevel_; }
+  size_t beam() const { return beam_; }
+  double beam_threshold() const { return beam_threshold_; }
+  unsigned int marginal_level() const { return marginal_level_; }
+  size_t unigram_cache_size() const { return unigram_cache_size_; }
   FeatureIndex *feature_index() const { return feature_index_.get(); }
+  ResultCache *result_cache() const { return result_cache_.get(); }
+  Cascade *cascade() const { return cascade_.get(); }
   const char *getTemplate() const;
 
+  size_t result_cache_hit() const {
+    return result_cache_.get() ? result_cache_->hit() : 0;
+  }
+  size_t result_cache_miss() const {
+    return result_cache_.get() ? result_cache_->miss() : 0;
+  }
+  size_t result_cache_eviction() const {
+    return result_cache_.get() ? result_cache_->eviction() : 0;
+  }
+
  private:
-  bool open(const Param &param);
   bool openFromArray(const Param &param,
                      const char *buf, size_t size);
+  // set the options of |param| up once feature_index_ is open
+  bool configure(const Param &param);
 
   whatlog       what_;
   unsigned int nbest_;
   unsigned int vlevel_;
+  size_t       beam_;
+  double       beam_threshold_;
+  unsigned int marginal_level_;
+  size_t       unigram_cache_size_;
   scoped_ptr<DecoderFeatureIndex> feature_index_;
+  scoped_ptr<ResultCache> result_cache_;
+  scoped_ptr<Cascade> cascade_;
+
+  // taggers and results reused by parseBatch()
+  std::vector<TaggerImpl *> batch_tagger_;
+  std::vector<std::string>  batch_output_;
+  mutex                     batch_mutex_;
 };
 
 class TaggerImpl : public Tagger {  // 这是算法核心单元
 		// 为train.data中的每个句子创建一个
  public:
   explicit TaggerImpl() : mode_(TEST), vlevel_(0), nbest_(0),
-                          ysize_(0), Z_(0), feature_id_(0),
+                          beam_(0), beam_threshold_(0.0), marginal_level_(0),
+                          ysize_(0), size_(0), Z_(0), feature_id_(0),
                           thread_id_(0), feature_index_(0),
-                          allocator_(0) {}
+                          allocator_(0), kbest_rank_(0), result_cache_(0),
+                          cached_(false), cached_nbest_(0), cascade_(0) {}
   virtual ~TaggerImpl() { close(); }
 
   Allocator *allocator() const {
@@ -70,11 +177,13 @@ class TaggerImpl : public Tagger {  // 这是算法核心单元
   size_t feature_id() const { return feature_id_; }
   void   set_thread_id(unsigned short id) { thread_id_ = id; }
   unsigned short thread_id() const { return thread_id_; }
-  Node  *node(size_t i, size_t j) const { return node_[i][j]; }
-
-	// 构建一句话的网络拓扑图
-	void   set_node(Node *n, size_t i, size_t j) { node_[i][j] = n; }
-
+  void   set_result_cache(ResultCache *cache) { result_cache_ = cache; }
+  // decode with |cascade| (0: none), owned by the model.
+  void   set_cascade(Cascade *cascade) {
+    cascade_ = cascade;
+    coarse_tagger_.reset(0);
+  }
+  Lattice *lattice() const { return allocator_->lattice(thread_id_); }
 
   // for LEARN mode
   bool         open(FeatureIndex *feature_index, Allocator *allocator);
@@ -99,44 +208,50 @@ class TaggerImpl : public Tagger {  // 这是算法核心单元
   bool         read(std::istream *is);
   void         close();
   bool         add(size_t size, const char **line);
+  bool         add_borrowed(size_t size, const char **line);
   bool         add(const char*);
-  size_t       size() const { return x_.size(); }
+  size_t       size() const { return size_; }
   size_t       xsize() const { return feature_index_->xsize(); }
   size_t       dsize() const { return feature_index_->size(); }
   const float *weight_vector() const { return feature_index_->alpha_float(); }
-  bool         empty() const { return x_.empty(); }
+  bool         empty() const { return size_ == 0; }
   size_t ysize() const { return ysize_; }
   double cost() const { return cost_; }
   double Z() const { return Z_; }
   double       prob() const { return std::exp(- cost_ - Z_); }
-  double       prob(size_t i, size_t j) const {
-    return toprob(node_[i][j], Z_);
-  }
+  double       prob(size_t i, size_t j) const;
   double       prob(size_t i) const {
-    return toprob(node_[i][result_[i]], Z_);
+    return prob(i, result_[i]);
   }
   void set_penalty(size_t i, size_t j, double penalty);
   double penalty(size_t i, size_t j) const;
-  double alpha(size_t i, size_t j) const { return node_[i][j]->alpha; }
-  double beta(size_t i, size_t j) const { return node_[i][j]->beta; }
-  double emission_cost(size_t i, size_t j) const { return node_[i][j]->cost; }
+  double alpha(size_t i, size_t j) const { return lattice()->alpha(i)[j]; }
+  double beta(size_t i, size_t j) const {
+    lattice()->backward();
+    return lattice()->beta(i)[j];
+  }
+  double emission_cost(size_t i, size_t j) const {
+    return lattice()->emission(i)[j];
+  }
+  // Transition costs are kept only when parse() computed probabilities
+  // or n-best paths; plain viterbi decoding does not store them.
   double next_transition_cost(size_t i, size_t j, size_t k) const {
-    return node_[i][j]->rpath[k]->cost;
+    return lattice()->transition(i + 1)[j * ysize_ + k];
   }
   double prev_transition_cost(size_t i, size_t j, size_t k) const {
-    return node_[i][j]->lpath[k]->cost;
+    return lattice()->transition(i)[k * ysize_ + j];
   }
   double best_cost(size_t i, size_t j) const {
-    return node_[i][j]->bestCost;
+    return lattice()->best(i)[j];
   }
-  const int *emission_vector(size_t i, size_t j) const {
-    return const_cast<int *>(node_[i][j]->fvector);
+  const int *emission_vector(size_t i, size_t) const {
+    return unigram_vector(i);
   }
-  const int* next_transition_vector(size_t i, size_t j, size_t k) const {
-    return node_[i][j]->rpath[k]->fvector;
+  const int* next_transition_vector(size_t i, size_t, size_t) const {
+    return bigram_vector(i + 1);
   }
-  const int* prev_transition_vector(size_t i, size_t j, size_t k) const {
-    return node_[i][j]->lpath[k]->fvector;
+  const int* prev_transition_vector(size_t i, size_t, size_t) const {
+    return bigram_vector(i);
   }
   size_t answer(size_t i) const { return answer_[i]; }
   size_t result(size_t i) const { return result_[i]; }
@@ -149,6 +264,10 @@ class TaggerImpl : public Tagger {  // 这是算法核心单元
   }
   const char* toString();
   const char* toString(char *, size_t);
+  const char* toBinary(size_t *size);
+  const char* binaryHeader(size_t *size);
+  bool        toArray(unsigned short *tags, float *marginals, size_t size);
+  bool        readBuffer(const char *input, size_t length);
   const char* parse(const char*);
   const char* parse(const char*, size_t);
   const char* parse(const char*, size_t, char*, size_t);
@@ -164,6 +283,28 @@ class TaggerImpl : public Tagger {  // 这是算法核心单元
 
   size_t nbest() const { return nbest_; }
 
+  size_t unigram_cache_hit() const {
+    return allocator_ && allocator_->unigram_cache() ?
+        allocator_->unigram_cache()->hit() : 0;
+  }
+
+  size_t unigram_cache_miss() const {
+    return allocator_ && allocator_->unigram_cache() ?
+        allocator_->unigram_cache()->miss() : 0;
+  }
+
+  size_t result_cache_hit() const {
+    return result_cache_ ? result_cache_->hit() : 0;
+  }
+
+  size_t result_cache_miss() const {
+    return result_cache_ ? result_cache_->miss() : 0;
+  }
+
+  size_t result_cache_eviction() const {
+    return result_cache_ ? result_cache_->eviction() : 0;
+  }
+
   void set_vlevel(unsigned int vlevel) {
     vlevel_ = vlevel;
   }
@@ -178,34 +319,81 @@ class TaggerImpl : public Tagger {  // 这是算法核心单元
     nbest_ = nbest;
   }
 
+  size_t beam() const { return beam_; }
+  void set_beam(size_t beam) { beam_ = beam; }
+  double beam_threshold() const { return beam_threshold_; }
+  void set_beam_threshold(double threshold) { beam_threshold_ = threshold; }
+  unsigned int marginal_level() const { return marginal_level_; }
+  void set_marginal_level(unsigned int level) { marginal_level_ = level; }
+
   const char* what() { return what_.str(); }
 
  private:
   void forwardbackward();
-  void viterbi();
+  // the viterbi searches return false if no path is left
+  bool viterbi();
+  // set cost_ from the score of the viterbi path
+  bool setBestPath(double score);
   void buildLattice();
+  Lattice *resizeLattice(bool shared_transition);
+  // fill the emission costs; with |prune|, only those of the tags the
+  // tag dictionary allows, which are then set on the lattice.
+  void buildEmission(bool prune);
+  bool viterbiLean();
+  // the marginal level in effect, see set_marginal_level()
+  unsigned int marginalLevel() const;
+  bool viterbiBeam();
+  // run the coarse model of the cascade and fill cascade_tag_.
+  bool buildCascade();
   bool initNbest();
   bool add2(size_t, const char **, bool);
+  bool addLine(char *line);
+  void printBinary(size_t rank);
+  void printSentence();
+  void makeCacheKey(std::string *key) const;
+  void storeCacheResult();
+
+  // feature ids of token i, and of the transition into token i (i >= 1)
+  const int *unigram_vector(size_t i) const {
+    return (*allocator_->feature_cache())[feature_id_ + i];
+  }
+  const int *bigram_vector(size_t i) const {
+    return (*allocator_->feature_cache())[feature_id_ + size_ + i - 1];
+  }
+  // features of the position-independent bigram rules, a prefix of
+  // every bigram_vector(i)
+  const int *static_bigram_vector() const {
+    return (*allocator_->feature_cache())[feature_id_ + 2 * size_ - 1];
+  }
 
-  struct QueueElement {
-    Node *node;
-    QueueElement *next;
-    double fx;
-    double gx;
+  // n-best search: a derivation of node (i, j) is the tag y at i - 1
+  // and the rank of the derivation of (i - 1, y) it extends.
+  struct Derivation {
+    double              score;
+    unsigned int        rank;
+    unsigned short int  y;
   };
 
-  class QueueElementComp {
+  class DerivationComp {
    public:
-    const bool operator()(QueueElement *q1,
-                          QueueElement *q2)
-    { return(q1->fx > q2->fx); }
+    bool operator()(const Derivation &d1, const Derivation &d2) const {
+      return d1.score < d2.score;
+    }
   };
 
+  bool findKbest(size_t i, size_t j, size_t rank);
+  void extendKbest(size_t i, size_t j, Derivation d);
+  double kbestScore(size_t i, size_t j, size_t y, double score) const;
+
   enum { TEST, TEST_SHARED, LEARN };
   unsigned int    mode_ ;
   unsigned int    vlevel_;
   unsigned int    nbest_;
+  size_t          beam_;
+  double          beam_threshold_;
+  unsigned int    marginal_level_;
   size_t          ysize_;  // len(状态集合)
+  size_t          size_;  // length of the sentence
   double          cost_;  // 目前的训练cost，我们的目标就是降低它
   double          Z_;  // 书中写的 p(y|x) 的分母(Z(X)这个归一化项)
   size_t          feature_id_;  // 当前对应的feature id
@@ -214,16 +402,46 @@ class TaggerImpl : public Tagger {  // 这是算法核心单元
   Allocator      *allocator_;  // 引用的内存管理单元
   std::vector<std::vector <const char *> > x_;  // 一句话(训练文件中)的解析结果
 		// [[the, DT, B], [we, DT, N],....]  // 注意是一句话哈哈哈
-  std::vector<std::vector <Node *> > node_;  // 一句话的网络拓扑矩阵(存的是节点的指针)
+  // x_ is not shrunk by clear(), so that its rows are reused by the
+  // next sentence. Only the first size_ rows are valid.
   std::vector<std::vector<double> > penalty_;  // 惩罚： 每个节点的人工罚项(代价)
   std::vector<unsigned short int>  answer_; // 训练数据的真实标签序列
   std::vector<unsigned short int>  result_;  // 模型对训练数据用viterbi预测的结果序列
   whatlog       what_;
   string_buffer os_;
+  std::vector<char>         input_buffer_;   // copy of the parse() input
+  std::vector<double>       prob_buffer_;    // marginals of one token
+  std::vector<double>       transition_sum_; // static bigram costs
+  std::vector<int>          beam_feature_;   // bigram ids of one row
+
+  // Lazy k-best search (Huang and Chiang, 2005) over the viterbi
+  // lattice. Node i * ysize + j is (i, j), and node size * ysize ends
+  // every path. kbest_ holds the derivations of a node found so far,
+  // best first; the first one of (i, j) is the viterbi back pointer.
+  // kbest_candidate_ is the heap of the next ones.
+  std::vector<std::vector<Derivation> > kbest_;
+  std::vector<std::vector<Derivation> > kbest_candidate_;
+  std::vector<char>                     kbest_init_;
+  size_t                                kbest_rank_;  // paths returned
+
+  // Sentence-level result cache, shared with the model or owned in TEST
+  // mode (see --result-cache-size). When cached_ is
+  // set, the current result is served from cache_result_ and the lattice
+  // is not available.
+  ResultCache           *result_cache_;
+  bool                   cached_;
+  size_t                 cached_nbest_;
+  std::string            cache_key_;
+  ResultCache::Result    cache_result_;
 
-  scoped_ptr<std::priority_queue <QueueElement*, std::vector <QueueElement *>,
-                                  QueueElementComp> > agenda_;
-  scoped_ptr<FreeList <QueueElement> > nbest_freelist_;
+  // Coarse-to-fine decoding: the coarse model runs on a tagger of its
+  // own, and the tags kept at token i are cascade_tag_[cascade_begin_[i]]
+  // .. cascade_tag_[cascade_begin_[i + 1] - 1].
+  Cascade                         *cascade_;
+  scoped_ptr<TaggerImpl>           coarse_tagger_;
+  std::vector<unsigned short int>  cascade_tag_;
+  std::vector<size_t>              cascade_begin_;
+  std::vector<char>                coarse_keep_;
 };
 }
 #endif
@@ -8,6 +8,10 @@
 #ifndef CRFPP_THREAD_H_
 #define CRFPP_THREAD_H_
 
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
 #ifdef HAVE_PTHREAD_H
 #include <pthread.h>
 #else
@@ -31,6 +35,24 @@
 
 namespace CRFPP {
 
+inline size_t getCpuCount() {
+  size_t result = 1;
+#if defined(_WIN32) && !defined(__CYGWIN__)
+  SYSTEM_INFO si;
+  ::GetSystemInfo(&si);
+  result = si.dwNumberOfProcessors;
+#else
+#ifdef HAVE_SYS_CONF_SC_NPROCESSORS_CONF
+  const long n = sysconf(_SC_NPROCESSORS_CONF);
+  if (n == -1) {
+    return 1;
+  }
+  result = static_cast<size_t>(n);
+#endif
+#endif
+  return result;
+}
+
 class thread {
  private:
 #ifdef HAVE_PTHREAD_H
@@ -78,6 +100,133 @@ class thread {
 
   virtual ~thread() {}
 };
+
+class mutex {
+ private:
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t mutex_;
+#else
+#ifdef _WIN32
+  CRITICAL_SECTION mutex_;
+#endif
+#endif
+  mutex(const mutex &);
+  mutex &operator=(const mutex &);
+  friend class condition;
+
+ public:
+  void lock() {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&mutex_);
+#else
+#ifdef _WIN32
+    EnterCriticalSection(&mutex_);
+#endif
+#endif
+  }
+
+  void unlock() {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&mutex_);
+#else
+#ifdef _WIN32
+    LeaveCriticalSection(&mutex_);
+#endif
+#endif
+  }
+
+  mutex() {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&mutex_, 0);
+#else
+#ifdef _WIN32
+    InitializeCriticalSection(&mutex_);
+#endif
+#endif
+  }
+
+  virtual ~mutex() {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_destroy(&mutex_);
+#else
+#ifdef _WIN32
+    DeleteCriticalSection(&mutex_);
+#endif
+#endif
+  }
+};
+
+class condition {
+ private:
+#ifdef HAVE_PTHREAD_H
+  pthread_cond_t cond_;
+#else
+#ifdef _WIN32
+  CONDITION_VARIABLE cond_;
+#endif
+#endif
+  condition(const condition &);
+  condition &operator=(const condition &);
+
+ public:
+  // |m| must be locked by the caller
+  void wait(mutex *m) {
+#ifdef HAVE_PTHREAD_H
+    pthread_cond_wait(&cond_, &m->mutex_);
+#else
+#ifdef _WIN32
+    SleepConditionVariableCS(&cond_, &m->mutex_, INFINITE);
+#endif
+#endif
+  }
+
+  void signal() {
+#ifdef HAVE_PTHREAD_H
+    pthread_cond_signal(&cond_);
+#else
+#ifdef _WIN32
+    WakeConditionVariable(&cond_);
+#endif
+#endif
+  }
+
+  void broadcast() {
+#ifdef HAVE_PTHREAD_H
+    pthread_cond_broadcast(&cond_);
+#else
+#ifdef _WIN32
+    WakeAllConditionVariable(&cond_);
+#endif
+#endif
+  }
+
+  condition() {
+#ifdef HAVE_PTHREAD_H
+    pthread_cond_init(&cond_, 0);
+#else
+#ifdef _WIN32
+    InitializeConditionVariable(&cond_);
+#endif
+#endif
+  }
+
+  virtual ~condition() {
+#ifdef HAVE_PTHREAD_H
+    pthread_cond_destroy(&cond_);
+#endif
+  }
+};
+
+class scoped_lock {
+ private:
+  mutex *mutex_;
+  scoped_lock(const scoped_lock &);
+  scoped_lock &operator=(const scoped_lock &);
+
+ public:
+  explicit scoped_lock(mutex *m) : mutex_(m) { mutex_->lock(); }
+  ~scoped_lock() { mutex_->unlock(); }
+};
 }
 
 #endif